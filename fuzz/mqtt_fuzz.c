@@ -0,0 +1,106 @@
+/* Fuzz target for the decoders.
+   libFuzzer: clang -fsanitize=fuzzer,address -I. fuzz/mqtt_fuzz.c mqttparser.c
+   AFL / replay: build with -DMQTT_FUZZ_MAIN and pass input files as arguments */
+#include "mqttparser.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void fuzz_view(uint8_t *data, int size)
+{
+	mqtt_view_t view;
+	mqtt_view_iter_t iter;
+	mqtt_subscribe_item_payload_t item;
+	mqtt_text_t text;
+
+	if (mqtt_view_init(&view, data, size) <= 0)
+		return;
+	mqtt_view_topic(&view, &text);
+	mqtt_view_packetid(&view);
+	mqtt_view_payload(&view, &text);
+	mqtt_view_items(&view, &iter);
+	while (mqtt_view_next_item(&iter, &item))
+		;
+}
+
+static void fuzz_compact(uint8_t *data, int size)
+{
+	mqtt_compact_connect_t connect;
+	mqtt_compact_publish_t publish;
+	mqtt_compact_ack_t ack;
+	mqtt_compact_subscribe_t subscribe;
+
+	mqtt_compact_connect_read(&connect, data, size);
+	mqtt_compact_publish_read(&publish, data, size);
+	mqtt_compact_ack_read(&ack, data, size);
+	mqtt_compact_subscribe_read(&subscribe, data, size);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *input, size_t length)
+{
+	static mqtt_inbound_t inbound;
+	mqtt_frame_t items[64];
+	mqtt_frames_t frames;
+	mqtt_message_t message;
+	mqtt_packet_t packet;
+	int size = (int)length, error_pos, i;
+	/* exact size copy so that any overread hits the sanitizer redzone */
+	uint8_t *data = (uint8_t *)malloc(length ? length : 1);
+
+	memcpy(data, input, length);
+	mqtt_packet_init(&packet, data, size);
+	while (packet.head < packet.size)
+	{
+		mqtt_message_t checked;
+		mqtt_packet_t fused = packet;
+		int start = packet.head, valid_pos;
+		int result = mqtt_message_read_checked(&message, &packet, &error_pos);
+		int valid = mqtt_message_read_valid(&checked, &fused, &valid_pos);
+		if (error_pos < start || error_pos > size || valid_pos < start || valid_pos > size)
+			abort();
+		if (result != MQTT_OK)
+			break;
+		/* the fused pass must agree with decoding then validating */
+		if (valid != mqtt_message_validate(&message))
+			abort();
+	}
+
+	mqtt_frames_init(&frames, items, 64);
+	mqtt_frames_scan(&frames, data, size);
+	if (frames.consumed > size)
+		abort();
+	for (i = 0; i < frames.count; i++)
+	{
+		fuzz_view(data + items[i].offset, items[i].length);
+		fuzz_compact(data + items[i].offset, items[i].length);
+	}
+	fuzz_view(data, size);
+	fuzz_compact(data, size);
+	mqtt_inbound_load(&inbound, data, size);
+
+	free(data);
+	return 0;
+}
+
+#ifdef MQTT_FUZZ_MAIN
+int main(int argc, char *argv[])
+{
+	static uint8_t buffer[1 << 16];
+	int i;
+	for (i = 1; i < argc; i++)
+	{
+		FILE *file = fopen(argv[i], "rb");
+		size_t length;
+		if (file == NULL)
+		{
+			perror(argv[i]);
+			return 1;
+		}
+		length = fread(buffer, 1, sizeof(buffer), file);
+		fclose(file);
+		LLVMFuzzerTestOneInput(buffer, length);
+	}
+	printf("%d inputs\n", argc - 1);
+	return 0;
+}
+#endif
@@ -1,7 +1,9 @@
-#include "mqttparser.h"
+#include "mqttclient.h"
 #include <inttypes.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 #ifdef WIN32
 #include <WinSock2.h>
 #include <ws2tcpip.h>
@@ -89,9 +91,12 @@ int client_test(const char *host, const char *port)
     mqtt_packet_t packet;
     uint8_t buffer[128];
     uint16_t msgid = 1;
+    static mqtt_inbound_t inbound;
+    mqtt_message_t ack;
 
     if ((sockfd = client_connect(host, port)) < 0)
         return -1;
+    mqtt_inbound_init(&inbound);
 
     mqtt_connect_build(&message, "test", 1, 300);
     mqtt_send_message(&message, sockfd);
@@ -111,28 +116,34 @@ int client_test(const char *host, const char *port)
     mqtt_va_subscribe_build(&message, &msgid, "abc", 1, "xyz", 2, NULL);
     mqtt_send_message(&message, sockfd);
 
-    int count;
+    int count, deliver;
     for (count = 0; count < 8; ++count)
     {
         mqtt_packet_init(&packet, buffer, sizeof(buffer));
         packet.size = recv(sockfd, (char *)packet.data, packet.size, 0);
-        mqtt_message_read(&message, &packet);
+        if (packet.size <= 0)
+            break;
+        if (mqtt_message_read_checked(&message, &packet, NULL) != MQTT_OK)
+        {
+            printf("Packet in: malformed\n");
+            break;
+        }
         printf("Packet in: msg = %s\n", msg_name[message.header.ctrl >> 4]);
         switch (message.header.ctrl >> 4)
         {
         case PUBLISH:
-            {
-                char topic[20] = { 0 };
-                char msgtext[40] = {0};
-                strncpy(topic, (const char *)message.variable.publish.topic.text, message.variable.publish.topic.length);
-                strncpy(msgtext, (const char *)message.payload.publish.text, message.payload.publish.length);
-                printf("Data in: %s %s\n", topic, msgtext);
-            }
-            if ((message.header.ctrl >> 1) & 3)
-            {
-                mqtt_pub_xxx_build(&message, PUBACK, message.variable.publish.packetid);
-                mqtt_send_message(&message, sockfd);
-            }
+            deliver = mqtt_inbound_receive(&inbound, message.header.ctrl, message.variable.publish.packetid, &ack);
+            if (deliver)
+                printf("Data in: %.*s %.*s%s\n",
+                       message.variable.publish.topic.length, (const char *)message.variable.publish.topic.text,
+                       message.payload.publish.length, (const char *)message.payload.publish.text,
+                       deliver == MQTT_INBOUND_DUPLICATE ? " (duplicate?)" : "");
+            if (ack.header.ctrl)
+                mqtt_send_message(&ack, sockfd);
+            break;
+        case PUBREL:
+            mqtt_inbound_receive(&inbound, message.header.ctrl, message.variable.msgid, &ack);
+            mqtt_send_message(&ack, sockfd);
             break;
         }
     }
@@ -144,6 +155,200 @@ int client_test(const char *host, const char *port)
     return 0;
 }
 
+#define BENCH_LOOPS 5000000
+
+static double bench_seconds(clock_t start)
+{
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+static void bench_report(const char *name, clock_t start, long bytes)
+{
+    double secs = bench_seconds(start);
+    printf("%-24s %8.3f s %10.1f MB/s\n", name, secs, secs > 0 ? bytes / secs / 1e6 : 0.0);
+}
+
+#define BENCH_BUFFER  (1 << 20)
+#define BENCH_REPEATS 1000
+
+/* Splits a buffer of PUBLISH frames, serially and with the batch scanner. Random
+   sizes over 1 MiB keep the branch predictor from learning the length pattern */
+static void bench_frames(void)
+{
+    static uint8_t buffer[BENCH_BUFFER];
+    static mqtt_frame_t items[BENCH_BUFFER / 4];
+    static const char payload[300] = "x";
+    mqtt_frames_t frames;
+    mqtt_message_t message;
+    mqtt_packet_t packet;
+    int size = 0, count = 0, i, msgid = 1;
+    long sink = 0;
+    clock_t start;
+
+    for (i = 0; ; i++)
+    {
+        mqtt_publish_build(&message, i % 3 == 0, 0, &msgid, "sensors/room1/temperature", payload, rand() % 200);
+        mqtt_packet_init(&packet, buffer + size, sizeof(buffer) - size);
+        mqtt_message_write(&message, &packet);
+        if (packet.head > packet.size)
+            break;
+        size += packet.head;
+        count++;
+    }
+
+    start = clock();
+    for (i = 0; i < BENCH_REPEATS; i++)
+    {
+        int head;
+        for (head = 0; head < size; )
+        {
+            mqtt_packet_init(&packet, buffer + head, size - head);
+            head += mqtt_message_peek(&message, &packet);
+            sink++;
+        }
+    }
+    bench_report("frames_serial", start, (long)size * BENCH_REPEATS);
+
+    mqtt_frames_init(&frames, items, sizeof(items) / sizeof(items[0]));
+    start = clock();
+    for (i = 0; i < BENCH_REPEATS; i++)
+        sink += mqtt_frames_scan(&frames, buffer, size);
+    bench_report("frames_scan", start, (long)size * BENCH_REPEATS);
+    printf("%d frames, qos0 %d qos1 %d\n", frames.count, frames.qos[0], frames.qos[1]);
+    if (sink != 2L * count * BENCH_REPEATS || frames.consumed != size)
+        printf("frame scan mismatch\n");
+}
+
+#define BENCH_ROUNDS 10
+
+/* Cost of validating in the decoder, per frame, for a range of topic
+   lengths; best of BENCH_ROUNDS rounds, single runs are too noisy */
+static long bench_validate(void)
+{
+    static const int lengths[] = { 8, 16, 24, 32, 64, 128 };
+    mqtt_message_t message;
+    mqtt_packet_t packet;
+    uint8_t frame[256];
+    char topic[160];
+    int size, n, i, round, msgid = 1, error_pos;
+    long sink = 0;
+
+    for (n = 0; n < (int)(sizeof(lengths) / sizeof(lengths[0])); n++)
+    {
+        double checked = 0, valid = 0;
+
+        /* levels of "sensor/" style names */
+        for (i = 0; i < lengths[n]; i++)
+            topic[i] = (i % 8 == 7) ? '/' : (char)('a' + i % 8);
+        topic[lengths[n]] = 0;
+        mqtt_publish_build(&message, 1, 0, &msgid, topic, "21.5", 4);
+        mqtt_packet_init(&packet, frame, sizeof(frame));
+        mqtt_message_write(&message, &packet);
+        size = packet.head;
+
+        for (round = 0; round < BENCH_ROUNDS; round++)
+        {
+            clock_t start = clock();
+            double secs;
+            for (i = 0; i < BENCH_LOOPS / BENCH_ROUNDS; i++)
+            {
+                mqtt_packet_init(&packet, frame, size);
+                sink += mqtt_message_read_checked(&message, &packet, &error_pos) == MQTT_OK;
+            }
+            secs = bench_seconds(start);
+            if (round == 0 || secs < checked)
+                checked = secs;
+            start = clock();
+            for (i = 0; i < BENCH_LOOPS / BENCH_ROUNDS; i++)
+            {
+                mqtt_packet_init(&packet, frame, size);
+                sink += mqtt_message_read_valid(&message, &packet, &error_pos) == MQTT_OK;
+            }
+            secs = bench_seconds(start);
+            if (round == 0 || secs < valid)
+                valid = secs;
+        }
+        checked *= 1e9 / (BENCH_LOOPS / BENCH_ROUNDS);
+        valid *= 1e9 / (BENCH_LOOPS / BENCH_ROUNDS);
+        printf("topic %3d bytes: checked %5.1f ns, valid %5.1f ns, validation %+4.0f%%\n",
+               lengths[n], checked, valid, checked > 0 ? (valid / checked - 1) * 100 : 0.0);
+    }
+    return sink;
+}
+
+int bench_test(void)
+{
+    mqtt_message_t message;
+    mqtt_packet_t packet;
+    uint8_t frame[128];
+    int size, i;
+    long sink = 0;
+    clock_t start;
+
+    i = 1;
+    mqtt_publish_build(&message, 1, 0, &i, "sensors/room1/temperature", "21.5", 4);
+    mqtt_packet_init(&packet, frame, sizeof(frame));
+    mqtt_message_write(&message, &packet);
+    size = packet.head;
+
+    start = clock();
+    for (i = 0; i < BENCH_LOOPS; i++)
+    {
+        mqtt_packet_init(&packet, frame, size);
+        mqtt_message_read(&message, &packet);
+        sink += message.variable.publish.topic.length;
+    }
+    bench_report("message_read", start, (long)size * BENCH_LOOPS);
+
+    start = clock();
+    for (i = 0; i < BENCH_LOOPS; i++)
+    {
+        mqtt_view_t view;
+        mqtt_text_t topic;
+        mqtt_view_init(&view, frame, size);
+        sink += mqtt_view_topic(&view, &topic);
+    }
+    bench_report("view_topic", start, (long)size * BENCH_LOOPS);
+
+    start = clock();
+    for (i = 0; i < BENCH_LOOPS; i++)
+    {
+        int error_pos;
+        mqtt_packet_init(&packet, frame, size);
+        sink += mqtt_message_read_checked(&message, &packet, &error_pos) == MQTT_OK;
+    }
+    bench_report("message_read_checked", start, (long)size * BENCH_LOOPS);
+
+    start = clock();
+    for (i = 0; i < BENCH_LOOPS; i++)
+    {
+        int error_pos;
+        mqtt_packet_init(&packet, frame, size);
+        sink += mqtt_message_read_valid(&message, &packet, &error_pos) == MQTT_OK;
+    }
+    bench_report("message_read_valid", start, (long)size * BENCH_LOOPS);
+
+    start = clock();
+    for (i = 0; i < BENCH_LOOPS; i++)
+    {
+        mqtt_compact_publish_t compact;
+        mqtt_compact_publish_read(&compact, frame, size);
+        sink += compact.topic.length;
+    }
+    bench_report("compact_publish_read", start, (long)size * BENCH_LOOPS);
+
+    sink += bench_validate();
+    bench_frames();
+
+    printf("sizeof mqtt_message_t           %4d\n", (int)sizeof(mqtt_message_t));
+    printf("sizeof mqtt_compact_connect_t   %4d\n", (int)sizeof(mqtt_compact_connect_t));
+    printf("sizeof mqtt_compact_publish_t   %4d\n", (int)sizeof(mqtt_compact_publish_t));
+    printf("sizeof mqtt_compact_subscribe_t %4d\n", (int)sizeof(mqtt_compact_subscribe_t));
+    printf("sizeof mqtt_compact_ack_t       %4d\n", (int)sizeof(mqtt_compact_ack_t));
+
+    return sink == 0;
+}
+
 int main(int argc, char *argv[])
 {
     int i ;
@@ -166,6 +371,8 @@ int main(int argc, char *argv[])
             mqtt_client_test(host, port);
         else if (strcmp("--client", argv[i]) == 0)
             return client_test(host, port);
+        else if (strcmp("--bench", argv[i]) == 0)
+            return bench_test();
     return 0;
 }
 
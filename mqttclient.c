@@ -1,46 +1,121 @@
-#include "mqttparser.h"
+#include "mqttclient.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #ifdef WIN32
-#include <WinSock2.h>
-#include <ws2tcpip.h>
 #define close closesocket
+#define poll WSAPoll
 #else
-#include <sys/types.h>
-#include <sys/socket.h>
+#include <poll.h>
 #include <arpa/inet.h>
-#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
 #endif
 
+#define MQTT_ATTEMPT_DELAY_MS 250   // Happy Eyeballs delay between attempts
+#define MQTT_CONNECT_TIMEOUT  10000 // whole connect phase, ms
+#define MQTT_BACKOFF_MIN_MS   100
+#define MQTT_BACKOFF_MAX_MS   30000
 
-/* Definition os  few message handlers */
-typedef struct mqtt_client_s mqtt_client_t;
-typedef void(*mqtt_on_connect_t)(mqtt_client_t *);
-typedef void(*mqtt_on_publish_t)(mqtt_client_t *, const mqtt_text_t *topic, const mqtt_text_t *message);
+#ifdef _MSC_VER
+#define mqtt_fence() MemoryBarrier()
+#define mqtt_cas(ptr, old, value) (InterlockedCompareExchange((volatile LONG *)(ptr), (LONG)(value), (LONG)(old)) == (LONG)(old))
+#else
+#define mqtt_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define mqtt_cas(ptr, old, value) __sync_bool_compare_and_swap(ptr, old, value)
+#endif
+
+#define MQTT_LVC_BLOB_HEADER 8 // blob size and owning slot
+
+static long long mqtt_clock_ms(void)
+{
+#ifdef WIN32
+	return (long long)GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+static void mqtt_sleep_ms(int ms)
+{
+#ifdef WIN32
+	Sleep(ms);
+#else
+	struct timespec ts;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (long)(ms % 1000) * 1000000;
+	nanosleep(&ts, NULL);
+#endif
+}
+
+static void mqtt_socket_blocking(int sockfd, int blocking)
+{
+#ifdef WIN32
+	u_long mode = blocking ? 0 : 1;
+	ioctlsocket(sockfd, FIONBIO, &mode);
+#else
+	int flags = fcntl(sockfd, F_GETFL, 0);
+	fcntl(sockfd, F_SETFL, blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK));
+#endif
+}
+
+static int mqtt_socket_pending(void)
+{
+#ifdef WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EINPROGRESS || errno == EWOULDBLOCK;
+#endif
+}
+
+/* Only the builder arguments are kept in the session: CONNECT is encoded
+   into the send buffer at connect time. Returns its size, -1 if it does not fit */
+static int mqtt_client_encode_connect(mqtt_client_t *self)
+{
+	mqtt_message_t connectmsg;
+	mqtt_packet_t packet;
+	mqtt_connect_build(&connectmsg, self->client_id, self->clean, self->keepalive);
+	if (self->username)
+		mqtt_connect_credentials(&connectmsg, self->username, self->password, self->passlen);
+	mqtt_packet_init(&packet, self->buffer, sizeof(self->buffer));
+	mqtt_message_write(&connectmsg, &packet);
+	return packet.head > packet.size ? -1 : packet.head;
+}
 
-struct mqtt_client_s
+/* Closes the connection, if any; the session state is kept */
+static void mqtt_client_drop(mqtt_client_t *self)
 {
-	int               socket;
-	uint16_t          msgid;
-	uint8_t           buffer[256];
-	uint8_t           buffer_in[256];
-	mqtt_message_t    connectmsg;
-	mqtt_on_connect_t on_connect;
-	mqtt_on_publish_t on_publish;
-} ;
+	if (self->socket >= 0)
+		close(self->socket);
+	self->socket = -1;
+	self->buffer_len = 0;
+}
 
-void mqtt_client_init(mqtt_client_t *self, const char *client_id, int clean, uint16_t keepalive)
+int mqtt_client_init(mqtt_client_t *self, const char *client_id, int clean, uint16_t keepalive)
 {
 	memset(self, 0, sizeof(mqtt_client_t));
-	mqtt_connect_build(&self->connectmsg, client_id, clean, keepalive);
+	self->client_id = client_id;
+	self->clean = (uint8_t)(clean != 0);
+	self->keepalive = keepalive;
 	self->msgid = 1;
+	self->socket = -1;
+	self->backoff_ms = MQTT_BACKOFF_MIN_MS;
+	self->connack_ms = -1;
+	return mqtt_client_encode_connect(self) < 0 ? -1 : 0;
 }
 
-void mqtt_client_credentials(mqtt_client_t *self, const char *username, const char *password, int passlen)
+int mqtt_client_credentials(mqtt_client_t *self, const char *username, const char *password, int passlen)
 {
-	mqtt_connect_credentials(&self->connectmsg, username, password, passlen);
+	self->username = username;
+	self->password = password;
+	self->passlen = (uint16_t)passlen;
+	return mqtt_client_encode_connect(self) < 0 ? -1 : 0;
 }
 
 void mqtt_client_callbacks(mqtt_client_t *self, mqtt_on_connect_t on_connect, mqtt_on_publish_t on_publish)
@@ -49,85 +124,712 @@ void mqtt_client_callbacks(mqtt_client_t *self, mqtt_on_connect_t on_connect, mq
 	self->on_publish = on_publish;
 }
 
+/* ttl is in ms */
+void mqtt_addr_cache_init(mqtt_addr_cache_t *cache, int ttl)
+{
+	memset(cache, 0, sizeof(mqtt_addr_cache_t));
+	cache->ttl = ttl;
+}
+
+/* Copies a consistent snapshot of a shared cache */
+static void mqtt_addr_cache_read(const mqtt_addr_cache_t *cache, mqtt_addr_cache_t *local)
+{
+	for (;;)
+	{
+		uint32_t seq = cache->seq;
+		mqtt_fence();
+		if (seq & 1)
+			continue;
+		memcpy(local, (const void *)cache, sizeof(mqtt_addr_cache_t));
+		mqtt_fence();
+		if (cache->seq == seq)
+			return;
+	}
+}
+
+/* Publishes a refreshed copy. A writer already publishing is not waited
+   for: its addresses are as fresh, this copy is simply dropped */
+static void mqtt_addr_cache_publish(mqtt_addr_cache_t *cache, const mqtt_addr_cache_t *local)
+{
+	uint32_t seq = cache->seq;
+	if ((seq & 1) || !mqtt_cas(&cache->seq, seq, seq + 1))
+		return;
+	mqtt_fence();
+	memcpy(cache->host, local->host, sizeof(cache->host));
+	memcpy(cache->port, local->port, sizeof(cache->port));
+	memcpy(cache->addr, local->addr, sizeof(cache->addr));
+	memcpy(cache->addrlen, local->addrlen, sizeof(cache->addrlen));
+	cache->count = local->count;
+	cache->expires = local->expires;
+	mqtt_fence();
+	cache->seq = seq + 2;
+}
+
+/* Shares a resolver cache among clients, NULL resolves on every connect */
+void mqtt_client_addr_cache(mqtt_client_t *self, mqtt_addr_cache_t *cache)
+{
+	self->cache = cache;
+}
+
+/* Carries CONNECT in the SYN where the platform supports TCP Fast Open */
+void mqtt_client_fastopen(mqtt_client_t *self, int enable)
+{
+	self->fastopen = (uint8_t)(enable != 0);
+}
+
+/* From on_publish: 1 if the message may have been delivered before (QoS 1 with DUP) */
+int mqtt_client_duplicate(const mqtt_client_t *self)
+{
+	return self->duplicate;
+}
+
+/* Time to CONNACK of the last connection in ms, -1 if not received yet */
+int mqtt_client_connack_ms(const mqtt_client_t *self)
+{
+	return self->connack_ms;
+}
+
+/* entries must be a power of two (at least 4); no memory is allocated by the cache */
+void mqtt_lvc_init(mqtt_lvc_t *self, mqtt_lvc_entry_t *entries, int count,
+	               uint8_t *arena, int size, int retained_only)
+{
+	memset(self, 0, sizeof(mqtt_lvc_t));
+	memset(entries, 0, sizeof(mqtt_lvc_entry_t) * count);
+	self->entries = entries;
+	self->mask = count - 1;
+	self->head = -1;
+	self->tail = -1;
+	self->arena = arena;
+	self->arena_size = (uint32_t)size & ~3u;
+	self->retained_only = retained_only;
+}
+
+static uint32_t mqtt_lvc_hash(const uint8_t *text, int length)
+{
+	uint32_t hash = 2166136261u; // FNV-1a
+	int i;
+	for (i = 0; i < length; i++)
+		hash = (hash ^ text[i]) * 16777619u;
+	return hash;
+}
+
+static void mqtt_lvc_blob_set(mqtt_lvc_t *self, uint32_t offset, uint32_t size, int32_t slot)
+{
+	memcpy(self->arena + offset, &size, 4);
+	memcpy(self->arena + offset + 4, &slot, 4);
+}
+
+static void mqtt_lvc_unlink(mqtt_lvc_t *self, int slot)
+{
+	mqtt_lvc_entry_t *entry = &self->entries[slot];
+	if (entry->prev >= 0)
+		self->entries[entry->prev].next = entry->next;
+	else
+		self->head = entry->next;
+	if (entry->next >= 0)
+		self->entries[entry->next].prev = entry->prev;
+	else
+		self->tail = entry->prev;
+}
+
+static void mqtt_lvc_push_front(mqtt_lvc_t *self, int slot)
+{
+	mqtt_lvc_entry_t *entry = &self->entries[slot];
+	entry->prev = -1;
+	entry->next = self->head;
+	if (self->head >= 0)
+		self->entries[self->head].prev = slot;
+	else
+		self->tail = slot;
+	self->head = slot;
+}
+
+/* Returns the slot holding topic or -(free slot) - 1 */
+static int mqtt_lvc_find(mqtt_lvc_t *self, uint32_t hash, const mqtt_text_t *topic)
+{
+	int i = hash & self->mask;
+	for (;;)
+	{
+		mqtt_lvc_entry_t *entry = &self->entries[i];
+		if (!entry->used)
+			return -i - 1;
+		if (entry->hash == hash && entry->topic_len == topic->length &&
+			memcmp(self->arena + entry->blob + MQTT_LVC_BLOB_HEADER, topic->text, topic->length) == 0)
+			return i;
+		i = (i + 1) & self->mask;
+	}
+}
+
+/* Moves an entry to a free slot keeping list links and blob owner in sync */
+static void mqtt_lvc_move(mqtt_lvc_t *self, int from, int to)
+{
+	mqtt_lvc_entry_t *entry = &self->entries[to];
+	*entry = self->entries[from];
+	self->entries[from].used = 0;
+	if (entry->prev >= 0)
+		self->entries[entry->prev].next = to;
+	else
+		self->head = to;
+	if (entry->next >= 0)
+		self->entries[entry->next].prev = to;
+	else
+		self->tail = to;
+	mqtt_lvc_blob_set(self, entry->blob, MQTT_LVC_BLOB_HEADER + entry->topic_len + entry->capacity, to);
+}
+
+/* Removes with backward shift so that probing never meets tombstones */
+static void mqtt_lvc_remove(mqtt_lvc_t *self, int slot)
+{
+	mqtt_lvc_entry_t *entry = &self->entries[slot];
+	int i = slot, j = slot;
+
+	mqtt_lvc_unlink(self, slot);
+	mqtt_lvc_blob_set(self, entry->blob, MQTT_LVC_BLOB_HEADER + entry->topic_len + entry->capacity, -1);
+	entry->used = 0;
+	self->count--;
+	for (;;)
+	{
+		int k;
+		j = (j + 1) & self->mask;
+		if (!self->entries[j].used)
+			break;
+		k = self->entries[j].hash & self->mask;
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		mqtt_lvc_move(self, j, i);
+		i = j;
+	}
+}
+
+/* Slides live blobs to the start of the arena */
+static void mqtt_lvc_compact(mqtt_lvc_t *self)
+{
+	uint32_t read = 0, write = 0;
+	while (read < self->arena_head)
+	{
+		uint32_t size;
+		int32_t slot;
+		memcpy(&size, self->arena + read, 4);
+		memcpy(&slot, self->arena + read + 4, 4);
+		if (slot >= 0)
+		{
+			if (write != read)
+				memmove(self->arena + write, self->arena + read, size);
+			self->entries[slot].blob = write;
+			write += size;
+		}
+		read += size;
+	}
+	self->arena_head = write;
+}
+
+/* Allocates a blob evicting least recently updated topics, -1 if it cannot fit */
+static int64_t mqtt_lvc_alloc(mqtt_lvc_t *self, uint32_t size)
+{
+	uint32_t offset;
+	if (size > self->arena_size)
+		return -1;
+	while (self->arena_head + size > self->arena_size)
+	{
+		mqtt_lvc_compact(self);
+		if (self->arena_head + size <= self->arena_size)
+			break;
+		if (self->tail < 0)
+			return -1;
+		mqtt_lvc_remove(self, self->tail);
+	}
+	offset = self->arena_head;
+	self->arena_head += size;
+	return offset;
+}
+
+/* Stores the last value of topic; called by the client thread only */
+int mqtt_lvc_store(mqtt_lvc_t *self, const mqtt_text_t *topic, const mqtt_text_t *payload, int retained)
+{
+	uint32_t hash, size;
+	int64_t offset;
+	int slot, result = 0;
+	mqtt_lvc_entry_t *entry;
+
+	if (self->retained_only && !retained)
+		return 0;
+	hash = mqtt_lvc_hash(topic->text, topic->length);
+	self->seq++;
+	mqtt_fence();
+	slot = mqtt_lvc_find(self, hash, topic);
+	if (slot >= 0 && payload->length <= self->entries[slot].capacity)
+	{
+		/* same topic, payload fits in place */
+		entry = &self->entries[slot];
+		memcpy(self->arena + entry->blob + MQTT_LVC_BLOB_HEADER + entry->topic_len, payload->text, payload->length);
+		entry->payload_len = payload->length;
+		entry->retained = (uint8_t)retained;
+		mqtt_lvc_unlink(self, slot);
+		mqtt_lvc_push_front(self, slot);
+	}
+	else
+	{
+		if (slot >= 0)
+			mqtt_lvc_remove(self, slot);
+		while (self->count + 1 > (self->mask + 1) * 3 / 4 && self->tail >= 0)
+			mqtt_lvc_remove(self, self->tail);
+		size = (MQTT_LVC_BLOB_HEADER + topic->length + payload->length + 3) & ~3u;
+		if ((offset = mqtt_lvc_alloc(self, size)) < 0)
+			result = -1;
+		else
+		{
+			slot = -mqtt_lvc_find(self, hash, topic) - 1;
+			entry = &self->entries[slot];
+			entry->hash = hash;
+			entry->blob = (uint32_t)offset;
+			entry->capacity = size - MQTT_LVC_BLOB_HEADER - topic->length;
+			entry->topic_len = topic->length;
+			entry->payload_len = payload->length;
+			entry->retained = (uint8_t)retained;
+			entry->used = 1;
+			mqtt_lvc_blob_set(self, entry->blob, size, slot);
+			memcpy(self->arena + entry->blob + MQTT_LVC_BLOB_HEADER, topic->text, topic->length);
+			memcpy(self->arena + entry->blob + MQTT_LVC_BLOB_HEADER + topic->length, payload->text, payload->length);
+			mqtt_lvc_push_front(self, slot);
+			self->count++;
+		}
+	}
+	mqtt_fence();
+	self->seq++;
+	return result;
+}
+
+/* Copies the last payload of topic into data, safe from any thread. Returns
+   the payload length (possibly larger than size) or -1 if the topic is unknown */
+int mqtt_lvc_get(const mqtt_lvc_t *self, const char *topic, int topic_len,
+	             uint8_t *data, int size, int *retained)
+{
+	uint32_t hash = mqtt_lvc_hash((const uint8_t *)topic, topic_len);
+	for (;;)
+	{
+		uint32_t seq = self->seq;
+		int i, probe, result = -1, flag = 0;
+
+		mqtt_fence();
+		if (seq & 1)
+			continue;
+		i = hash & self->mask;
+		for (probe = 0; probe <= self->mask; probe++)
+		{
+			/* the entry may be torn by a concurrent update: check bounds before touching the arena */
+			mqtt_lvc_entry_t entry = self->entries[i];
+			if (!entry.used)
+				break;
+			if (entry.hash == hash && entry.topic_len == topic_len &&
+				(uint64_t)entry.blob + MQTT_LVC_BLOB_HEADER + entry.topic_len + entry.payload_len <= self->arena_size &&
+				memcmp(self->arena + entry.blob + MQTT_LVC_BLOB_HEADER, topic, topic_len) == 0)
+			{
+				memcpy(data, self->arena + entry.blob + MQTT_LVC_BLOB_HEADER + topic_len,
+					   entry.payload_len < size ? entry.payload_len : size);
+				result = entry.payload_len;
+				flag = entry.retained;
+				break;
+			}
+			i = (i + 1) & self->mask;
+		}
+		mqtt_fence();
+		if (self->seq == seq)
+		{
+			if (retained && result >= 0)
+				*retained = flag;
+			return result;
+		}
+	}
+}
+
+/* Attaches a last value cache updated by every incoming PUBLISH, NULL detaches it */
+void mqtt_client_lvc(mqtt_client_t *self, mqtt_lvc_t *lvc)
+{
+	self->lvc = lvc;
+}
+
+/* Attaches the receive session state used to drop QoS 1/2 redeliveries. 
+   Keep it (or its mqtt_inbound_save form) across reconnects with clean = 0 */
+void mqtt_client_inbound(mqtt_client_t *self, mqtt_inbound_t *inbound)
+{
+	self->inbound = inbound;
+}
+
+static void mqtt_client_flush_acks(mqtt_client_t *self)
+{
+	if (self->acks_size > 0)
+	{
+		send(self->socket, (const char *)self->acks, self->acks_size, 0);
+		self->metrics.bytes_out += self->acks_size;
+	}
+	self->acks_size = 0;
+}
+
+/* Acks are queued and leave with a single send once the receive buffer is processed */
+static void mqtt_client_queue_ack(mqtt_client_t *self, mqtt_message_t *ack)
+{
+	mqtt_packet_t packet;
+	if (self->acks_size + 4 > sizeof(self->acks))
+		mqtt_client_flush_acks(self);
+	mqtt_packet_init(&packet, self->acks + self->acks_size, sizeof(self->acks) - self->acks_size);
+	mqtt_message_write(ack, &packet);
+	self->acks_size += packet.head;
+}
+
+/* Returns 1 if the PUBLISH/PUBREL in view is new for the application */
+static int mqtt_client_inbound_receive(mqtt_client_t *self, mqtt_view_t *view)
+{
+	mqtt_message_t ack;
+	int packetid = mqtt_view_packetid(view);
+	int deliver;
+
+	if (packetid < 0)
+		return mqtt_view_type(view) == PUBLISH;
+	if (self->inbound)
+		deliver = mqtt_inbound_receive(self->inbound, view->ctrl, (uint16_t)packetid, &ack);
+	else
+	{
+		/* no session state: ack everything, duplicates reach the application */
+		int qos = mqtt_view_qos(view);
+		deliver = MQTT_INBOUND_DROP;
+		if (mqtt_view_type(view) == PUBLISH)
+		{
+			deliver = (view->ctrl & 0x08) ? MQTT_INBOUND_DUPLICATE : MQTT_INBOUND_DELIVER;
+			mqtt_pub_xxx_build(&ack, qos == 1 ? PUBACK : PUBREC, packetid);
+		}
+		else
+			mqtt_pub_xxx_build(&ack, PUBCOMP, packetid);
+	}
+	if (ack.header.ctrl)
+		mqtt_client_queue_ack(self, &ack);
+	return deliver;
+}
+
+/* Enables UTF-8 and topic validation of sent and received messages */
+void mqtt_client_validate(mqtt_client_t *self, int enable)
+{
+	self->validate = (uint8_t)(enable != 0);
+}
+
+/* Returns -1 if the message is invalid or the connection is lost (the
+   socket is then closed), the buffer size if the message does not fit */
 int mqtt_client_send(mqtt_client_t *self, mqtt_message_t *message)
 {
 	mqtt_packet_t packet;
+	if (self->socket < 0 || (self->validate && mqtt_message_validate(message) != MQTT_VALID))
+		return -1;
 	mqtt_packet_init(&packet, self->buffer, sizeof(self->buffer));
 	mqtt_message_write(message, &packet);
 	if (packet.head > packet.size)
 		return packet.size;
-	send(self->socket, (const char *)packet.data, packet.head, 0);
+	if (send(self->socket, (const char *)packet.data, packet.head, 0) != packet.head)
+	{
+		mqtt_client_drop(self);
+		return -1;
+	}
+	self->metrics.messages_out++;
+	self->metrics.bytes_out += packet.head;
 	return 0;
 }
 
-int mqtt_client_connect(mqtt_client_t *self, const char *host, const char *port)
+int mqtt_client_publish(mqtt_client_t *self, int qos, int retain, const char *topic, const char *msg, int msglen)
+{
+	mqtt_message_t message;
+	int msgid = self->msgid;
+	mqtt_publish_build(&message, qos, retain, qos ? &msgid : NULL, topic, msg, msglen);
+	self->msgid = (uint16_t)msgid ? (uint16_t)msgid : 1;
+	return mqtt_client_send(self, &message);
+}
+
+const mqtt_client_metrics_t *mqtt_client_metrics(const mqtt_client_t *self)
+{
+	return &self->metrics;
+}
+
+/* Fills cache with host addresses, alternating families as Happy Eyeballs suggests */
+static int mqtt_addr_resolve(mqtt_addr_cache_t *cache, const char *host, const char *port)
 {
 	struct addrinfo hints, *servinfo, *p;
-	int rv, sockfd = -1;
+	struct addrinfo *first[MQTT_ADDR_MAX], *other[MQTT_ADDR_MAX];
+	int nfirst = 0, nother = 0, i;
+
+	if (cache->count > 0 && cache->expires > mqtt_clock_ms() &&
+		strcmp(cache->host, host) == 0 && strcmp(cache->port, port) == 0)
+		return cache->count;
 
 	memset(&hints, 0, sizeof hints);
 	hints.ai_family = AF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
-
-	if ((rv = getaddrinfo(host, port, &hints, &servinfo)) != 0) 
+	if (getaddrinfo(host, port, &hints, &servinfo) != 0)
 		return -1;
 
-	// loop through all the results and connect to the first we can
-	for (p = servinfo; p != NULL; p = p->ai_next) {
-		if ((sockfd = socket(p->ai_family, p->ai_socktype,
-			p->ai_protocol)) == -1) {
-			continue;
+	/* first address of the preferred family, then interleave the others */
+	for (p = servinfo; p != NULL; p = p->ai_next)
+		if (p->ai_family == servinfo->ai_family && nfirst < MQTT_ADDR_MAX)
+			first[nfirst++] = p;
+		else if (p->ai_family != servinfo->ai_family && nother < MQTT_ADDR_MAX)
+			other[nother++] = p;
+	cache->count = 0;
+	for (i = 0; i < nfirst || i < nother; i++)
+	{
+		if (i < nfirst && cache->count < MQTT_ADDR_MAX)
+		{
+			memcpy(&cache->addr[cache->count], first[i]->ai_addr, first[i]->ai_addrlen);
+			cache->addrlen[cache->count++] = (int)first[i]->ai_addrlen;
+		}
+		if (i < nother && cache->count < MQTT_ADDR_MAX)
+		{
+			memcpy(&cache->addr[cache->count], other[i]->ai_addr, other[i]->ai_addrlen);
+			cache->addrlen[cache->count++] = (int)other[i]->ai_addrlen;
 		}
+	}
+	freeaddrinfo(servinfo); // all done with this structure
+
+	strncpy(cache->host, host, sizeof(cache->host) - 1);
+	strncpy(cache->port, port, sizeof(cache->port) - 1);
+	cache->expires = mqtt_clock_ms() + cache->ttl;
+	return cache->count;
+}
 
-		if (connect(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
+/* Starts a non blocking connection, possibly sending CONNECT in the SYN. 
+   Returns the socket or -1, *sent is set when CONNECT already left */
+static int mqtt_client_attempt(mqtt_client_t *self, struct sockaddr *addr, int addrlen, int size, int *sent)
+{
+	int sockfd, rv;
+
+	*sent = 0;
+	if ((sockfd = (int)socket(addr->sa_family, SOCK_STREAM, 0)) == -1)
+		return -1;
+	mqtt_socket_blocking(sockfd, 0);
+#ifdef MSG_FASTOPEN
+	if (self->fastopen)
+	{
+		rv = (int)sendto(sockfd, (const char *)self->buffer, size, MSG_FASTOPEN, addr, addrlen);
+		*sent = (rv == size);
+		if (rv >= 0 && !*sent)
+		{
+			/* partial write in the SYN, cannot resend safely */
 			close(sockfd);
-			sockfd = -1;
-			continue;
+			return -1;
 		}
-
-		break;
 	}
-	freeaddrinfo(servinfo); // all done with this structure
-	if (sockfd > 0)
+	/* client side TFO disabled by the system (net.ipv4.tcp_fastopen): plain connect */
+	if (!self->fastopen || (rv < 0 && errno == EOPNOTSUPP))
+#endif
+	rv = connect(sockfd, addr, addrlen);
+	if (rv < 0 && !mqtt_socket_pending())
 	{
-		self->socket = sockfd;
-		mqtt_client_send(self, &self->connectmsg);
+		close(sockfd);
+		return -1;
 	}
 	return sockfd;
 }
 
-int mqtt_client_loop(mqtt_client_t *self)
+/* Races connection attempts, starting the next one every MQTT_ATTEMPT_DELAY_MS 
+   until one completes or the timeout expires */
+static int mqtt_client_race(mqtt_client_t *self, mqtt_addr_cache_t *cache, int size, int *sent)
 {
-	int len;
-	for (len = 0; len < sizeof(self->buffer_in);)
+	int sockets[MQTT_ADDR_MAX], sents[MQTT_ADDR_MAX];
+	struct pollfd fds[MQTT_ADDR_MAX];
+	int index[MQTT_ADDR_MAX]; // attempt of each polled descriptor
+	int started = 0, i, winner = -1;
+	long long now = mqtt_clock_ms();
+	long long deadline = now + MQTT_CONNECT_TIMEOUT;
+	long long next = now;
+
+	while (winner < 0 && (now = mqtt_clock_ms()) < deadline)
 	{
-		int read = recv(self->socket, (char *)self->buffer_in + len, sizeof(self->buffer_in) - len, 0);
-		if (read > 0)
+		long long wait;
+		int pending = 0;
+
+		if (now >= next && started < cache->count)
+		{
+			sockets[started] = mqtt_client_attempt(self, (struct sockaddr *)&cache->addr[started],
+				                                   cache->addrlen[started], size, &sents[started]);
+			started++;
+			next = now + MQTT_ATTEMPT_DELAY_MS;
+		}
+		for (i = 0; i < started; i++)
+			if (sockets[i] >= 0)
+			{
+				fds[pending].fd = sockets[i];
+				fds[pending].events = POLLOUT;
+				fds[pending].revents = 0;
+				index[pending++] = i;
+			}
+		if (pending == 0)
+		{
+			if (started == cache->count)
+				break;
+			next = now; // all failed, start the next one right away
+			continue;
+		}
+		wait = (started < cache->count ? next : deadline) - now;
+		if (wait < 0)
+			wait = 0;
+		if (poll(fds, pending, (int)wait) <= 0)
+			continue;
+		for (i = 0; i < pending && winner < 0; i++)
 		{
-			mqtt_packet_t packet;
-			mqtt_message_t message;
-			len += read;
-			mqtt_packet_init(&packet, self->buffer_in, len);
-			if (mqtt_message_peek(&message, &packet) == len)
+			int error = 0;
+			socklen_t len = sizeof(error);
+			if (fds[i].revents == 0)
+				continue;
+			getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, (char *)&error, &len);
+			if (error == 0 && !(fds[i].revents & (POLLERR | POLLHUP)))
+				winner = index[i];
+			else
 			{
-				mqtt_message_read(&message, &packet);
-				switch (message.header.ctrl >> 4)
-				{
-				case PUBLISH:
-					if (self->on_publish)
-						self->on_publish(self, &message.variable.publish.topic, &message.payload.publish);
-					break;
-				case CONNACK:
-					if (self->on_connect)
-						self->on_connect(self);
-					break;
-				}
-				len = 0;
+				close(fds[i].fd);
+				sockets[index[i]] = -1;
 			}
 		}
+	}
+	for (i = 0; i < started; i++)
+		if (i != winner && sockets[i] >= 0)
+			close(sockets[i]);
+	if (winner < 0)
+		return -1;
+	*sent = sents[winner];
+	return sockets[winner];
+}
+
+int mqtt_client_connect(mqtt_client_t *self, const char *host, const char *port)
+{
+	mqtt_addr_cache_t cache; // private copy, the shared one is only read and published
+	long long expires;
+	int sockfd, sent, size, nodelay = 1;
+
+	if (self->cache)
+		mqtt_addr_cache_read(self->cache, &cache);
+	else
+		mqtt_addr_cache_init(&cache, 0);
+	expires = cache.expires;
+	mqtt_client_drop(self);
+	self->connect_start = mqtt_clock_ms();
+	self->connack_ms = -1;
+	if ((size = mqtt_client_encode_connect(self)) < 0 || mqtt_addr_resolve(&cache, host, port) <= 0)
+		return -1;
+	sockfd = mqtt_client_race(self, &cache, size, &sent);
+	if (sockfd < 0)
+		cache.expires = 0; // addresses may be stale
+	if (self->cache && cache.expires != expires)
+		mqtt_addr_cache_publish(self->cache, &cache);
+	if (sockfd < 0)
+		return -1;
+	mqtt_socket_blocking(sockfd, 1);
+	setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, (const char *)&nodelay, sizeof(nodelay));
+	self->socket = sockfd;
+	if (!sent)
+		send(sockfd, (const char *)self->buffer, size, 0);
+	self->metrics.connects++;
+	self->metrics.bytes_out += size;
+	return sockfd;
+}
+
+/* Connects retrying with jittered exponential backoff, at most attempts times (0 = forever) */
+int mqtt_client_reconnect(mqtt_client_t *self, const char *host, const char *port, int attempts)
+{
+	int count;
+	for (count = 0; attempts == 0 || count < attempts; count++)
+	{
+		int delay;
+		if (mqtt_client_connect(self, host, port) >= 0)
+		{
+			self->backoff_ms = MQTT_BACKOFF_MIN_MS;
+			return self->socket;
+		}
+		/* equal jitter: half fixed, half random so that sessions spread out */
+		delay = self->backoff_ms / 2 + rand() % (self->backoff_ms / 2 + 1);
+		mqtt_sleep_ms(delay);
+		if (self->backoff_ms < MQTT_BACKOFF_MAX_MS / 2)
+			self->backoff_ms *= 2;
 		else
-			break; // close connection?
-	} 
+			self->backoff_ms = MQTT_BACKOFF_MAX_MS;
+	}
+	return -1;
+}
+
+#define MQTT_LOOP_FRAMES 16
+
+/* Returns -1 for a malformed or invalid packet: the connection must be closed */
+static int mqtt_client_dispatch(mqtt_client_t *self, mqtt_view_t *view)
+{
+	mqtt_text_t topic, message;
+	self->metrics.messages_in++;
+	switch (mqtt_view_type(view))
+	{
+	case PUBLISH:
+		/* checked before the inbound step so that nothing invalid is acknowledged */
+		if (mqtt_view_topic(view, &topic) < 0 || mqtt_view_payload(view, &message) < 0)
+			return -1;
+		if (self->validate && mqtt_topic_validate(&topic) != MQTT_VALID)
+			return -1;
+		self->duplicate = mqtt_client_inbound_receive(self, view);
+		if (self->duplicate == MQTT_INBOUND_DROP)
+			break;
+		self->duplicate = self->duplicate == MQTT_INBOUND_DUPLICATE;
+		if (self->lvc)
+			mqtt_lvc_store(self->lvc, &topic, &message, view->ctrl & 0x01);
+		if (self->on_publish)
+			self->on_publish(self, &topic, &message);
+		break;
+	case PUBREL:
+		mqtt_client_inbound_receive(self, view);
+		break;
+	case CONNACK:
+		/* no session on the broker side, nothing will be redelivered */
+		if (self->inbound && view->length >= 1 && (view->data[view->offset] & 0x01) == 0)
+			mqtt_inbound_init(self->inbound);
+		self->connack_ms = (int)(mqtt_clock_ms() - self->connect_start);
+		if (self->on_connect)
+			self->on_connect(self);
+		break;
+	}
+	return 0;
+}
+
+/* One recv and the dispatch of the complete frames it ends; returns -1 when
+   the connection is closed by the broker, sends malformed input or a frame
+   larger than the buffer. The connection is left to the caller to drop */
+static int mqtt_client_receive(mqtt_client_t *self)
+{
+	mqtt_frame_t items[MQTT_LOOP_FRAMES];
+	mqtt_frames_t frames;
+	int i, read, invalid = 0;
+	int len = self->buffer_len;
+	if (len == sizeof(self->buffer_in))
+		return -1;
+	read = recv(self->socket, (char *)self->buffer_in + len, sizeof(self->buffer_in) - len, 0);
+	if (read <= 0)
+		return -1;
+	len += read;
+	self->metrics.bytes_in += read;
+	mqtt_frames_init(&frames, items, MQTT_LOOP_FRAMES);
+	/* Split the buffer in one pass, then dispatch: only the fields needed for routing are decoded */
+	do
+	{
+		mqtt_frames_scan(&frames, self->buffer_in, len);
+		for (i = 0; i < frames.count && !invalid; i++)
+		{
+			mqtt_view_t view;
+			mqtt_frame_view(&items[i], self->buffer_in, &view);
+			invalid = mqtt_client_dispatch(self, &view) < 0;
+		}
+		len -= frames.consumed;
+		memmove(self->buffer_in, self->buffer_in + frames.consumed, len);
+	} while (frames.count == MQTT_LOOP_FRAMES && !invalid);
+	self->buffer_len = (uint16_t)len;
+	/* acks of the messages delivered before an invalid one still go out */
+	mqtt_client_flush_acks(self);
+	return frames.malformed || invalid ? -1 : 0;
+}
+
+int mqtt_client_loop(mqtt_client_t *self)
+{
+	while (mqtt_client_receive(self) == 0)
+		;
+	mqtt_client_drop(self);
 	return 0;
 }
 
@@ -136,8 +838,238 @@ void mqtt_client_shutdown(mqtt_client_t *self)
 	mqtt_message_t message;
 	mqtt_disconnect_build(&message);
 	mqtt_client_send(self, &message);
+	mqtt_client_drop(self);
+}
 
-	close(self->socket);
+/* clients must be initialized with distinct client ids */
+int mqtt_shards_init(mqtt_shards_t *self, mqtt_client_t *clients, int count, const char **hosts, const char **ports)
+{
+	int i, j;
+	memset(self, 0, sizeof(mqtt_shards_t));
+	if (count > MQTT_SHARD_MAX)
+		return -1;
+	self->clients = clients;
+	self->hosts = hosts;
+	self->ports = ports;
+	self->count = count;
+	for (i = 0; i < count; i++)
+	{
+		for (j = 0; j < i; j++)
+			if (strcmp(hosts[i], hosts[j]) == 0 && strcmp(ports[i], ports[j]) == 0)
+				break;
+		self->endpoint[i] = (uint8_t)j;
+	}
+	return 0;
+}
+
+void mqtt_shards_callbacks(mqtt_shards_t *self, mqtt_on_connect_t on_connect, mqtt_on_publish_t on_publish)
+{
+	int i;
+	for (i = 0; i < self->count; i++)
+		mqtt_client_callbacks(&self->clients[i], on_connect, on_publish);
+}
+
+static uint32_t mqtt_shard_mix(uint32_t hash, uint32_t shard)
+{
+	hash ^= (shard + 1) * 0x9e3779b9u;
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	return hash ^ (hash >> 16);
+}
+
+/* Live shard with the highest score, among those of endpoint (-1 for any) */
+static int mqtt_shards_pick(const mqtt_shards_t *self, uint32_t hash, int endpoint)
+{
+	uint32_t best_score = 0;
+	int i, best = -1;
+	for (i = 0; i < self->count; i++)
+	{
+		uint32_t score;
+		if (self->clients[i].socket < 0 || (endpoint >= 0 && self->endpoint[i] != endpoint))
+			continue;
+		score = mqtt_shard_mix(hash, i);
+		if (best < 0 || score > best_score)
+		{
+			best = i;
+			best_score = score;
+		}
+	}
+	return best;
+}
+
+/* Live shard with the highest score for topic, -1 if all are down */
+int mqtt_shards_route(const mqtt_shards_t *self, const char *topic, int topic_len)
+{
+	return mqtt_shards_pick(self, mqtt_lvc_hash((const uint8_t *)topic, topic_len), -1);
+}
+
+static int mqtt_shards_sub_send(mqtt_shards_t *self, mqtt_shard_sub_t *sub, int shard, int subscribe)
+{
+	mqtt_message_t message;
+	mqtt_client_t *client = &self->clients[shard];
+	if (subscribe)
+		mqtt_subscribe_build(&message, &client->msgid, sub->topic, sub->qos);
+	else
+		mqtt_unsubscribe_build(&message, &client->msgid, sub->topic);
+	return mqtt_client_send(client, &message);
+}
+
+/* Shards that should hold sub: one live connection per distinct endpoint */
+static uint32_t mqtt_shards_placement(const mqtt_shards_t *self, const mqtt_shard_sub_t *sub)
+{
+	uint32_t hash = mqtt_lvc_hash((const uint8_t *)sub->topic, (int)strlen(sub->topic));
+	uint32_t shards = 0;
+	int i;
+	for (i = 0; i < self->count; i++)
+	{
+		int shard;
+		if (self->endpoint[i] != i)
+			continue;
+		if ((shard = mqtt_shards_pick(self, hash, i)) >= 0)
+			shards |= 1u << shard;
+	}
+	return shards;
+}
+
+/* Moves subscriptions whose owners changed after a shard went up or down.
+   A failed send takes its shard down, so the pass is repeated until stable */
+static void mqtt_shards_rebalance(mqtt_shards_t *self)
+{
+	int i, shard, lost;
+	do
+	{
+		uint32_t live = 0;
+		lost = 0;
+		for (shard = 0; shard < self->count; shard++)
+			if (self->clients[shard].socket >= 0)
+				live |= 1u << shard;
+		for (i = 0; i < self->subs_count; i++)
+		{
+			mqtt_shard_sub_t *sub = &self->subs[i];
+			uint32_t wanted = mqtt_shards_placement(self, sub);
+			/* subscriptions die with their connection */
+			sub->shards &= live;
+			for (shard = 0; shard < self->count; shard++)
+			{
+				uint32_t bit = 1u << shard;
+				if ((sub->shards & bit) && !(wanted & bit))
+				{
+					mqtt_shards_sub_send(self, sub, shard, 0);
+					sub->shards &= ~bit;
+				}
+				else if (!(sub->shards & bit) && (wanted & bit))
+				{
+					if (mqtt_shards_sub_send(self, sub, shard, 1) == 0)
+						sub->shards |= bit;
+					else
+						lost = 1;
+				}
+			}
+		}
+	} while (lost);
+}
+
+/* Connects every shard, returns how many are up */
+int mqtt_shards_connect(mqtt_shards_t *self)
+{
+	int i, up = 0;
+	for (i = 0; i < self->count; i++)
+		if (self->clients[i].socket >= 0 ||
+			mqtt_client_connect(&self->clients[i], self->hosts[i], self->ports[i]) >= 0)
+			up++;
+	mqtt_shards_rebalance(self);
+	return up;
+}
+
+/* Called when a shard connection is lost (or to drain it) */
+void mqtt_shards_down(mqtt_shards_t *self, int shard)
+{
+	mqtt_client_drop(&self->clients[shard]);
+	mqtt_shards_rebalance(self);
+}
+
+int mqtt_shards_loop(mqtt_shards_t *self, int timeout_ms)
+{
+	struct pollfd fds[MQTT_SHARD_MAX];
+	int index[MQTT_SHARD_MAX]; // shard of each polled descriptor
+	int i, live = 0;
+	for (i = 0; i < self->count; i++)
+	{
+		if (self->clients[i].socket < 0)
+			continue;
+		fds[live].fd = self->clients[i].socket;
+		fds[live].events = POLLIN;
+		fds[live].revents = 0;
+		index[live++] = i;
+	}
+	if (live == 0 || poll(fds, live, timeout_ms) <= 0)
+		return live;
+	for (i = 0; i < live; i++)
+	{
+		mqtt_client_t *client = &self->clients[index[i]];
+		/* an earlier dispatch may have dropped it while sending */
+		if (!fds[i].revents || client->socket != fds[i].fd)
+			continue;
+		if (mqtt_client_receive(client) < 0)
+			mqtt_shards_down(self, index[i]);
+	}
+	for (i = 0, live = 0; i < self->count; i++)
+		live += self->clients[i].socket >= 0;
+	return live;
+}
+
+/* Reconnects a shard and gives its topics back */
+int mqtt_shards_up(mqtt_shards_t *self, int shard)
+{
+	if (mqtt_client_connect(&self->clients[shard], self->hosts[shard], self->ports[shard]) < 0)
+		return -1;
+	mqtt_shards_rebalance(self);
+	return 0;
+}
+
+int mqtt_shards_publish(mqtt_shards_t *self, int qos, int retain, const char *topic, const char *msg, int msglen)
+{
+	int shard, rv;
+	while ((shard = mqtt_shards_route(self, topic, (int)strlen(topic))) >= 0)
+	{
+		rv = mqtt_client_publish(&self->clients[shard], qos, retain, topic, msg, msglen);
+		if (self->clients[shard].socket >= 0)
+			return rv;
+		/* connection lost while sending: move its topics and retry */
+		mqtt_shards_rebalance(self);
+	}
+	return -1;
+}
+
+/* Subscribes once per distinct endpoint; topic must stay valid */
+int mqtt_shards_subscribe(mqtt_shards_t *self, const char *topic, int qos)
+{
+	mqtt_shard_sub_t *sub;
+	if (self->subs_count == MQTT_SHARD_SUBS)
+		return -1;
+	sub = &self->subs[self->subs_count++];
+	sub->topic = topic;
+	sub->qos = qos;
+	sub->shards = 0;
+	mqtt_shards_rebalance(self);
+	return 0;
+}
+
+void mqtt_shards_metrics(const mqtt_shards_t *self, mqtt_client_metrics_t *metrics)
+{
+	int i;
+	memset(metrics, 0, sizeof(mqtt_client_metrics_t));
+	for (i = 0; i < self->count; i++)
+	{
+		const mqtt_client_metrics_t *item = &self->clients[i].metrics;
+		metrics->messages_out += item->messages_out;
+		metrics->messages_in += item->messages_in;
+		metrics->bytes_out += item->bytes_out;
+		metrics->bytes_in += item->bytes_in;
+		metrics->connects += item->connects;
+	}
 }
 
 void on_test_connect(mqtt_client_t *self)
@@ -159,7 +1091,7 @@ void mqtt_client_test(const char *host, const char *port)
 	mqtt_client_init(&client, "test", 0, 300);
 	mqtt_client_callbacks(&client, on_test_connect, on_test_publish);
     printf("Starting client test\n") ;
-	if (mqtt_client_connect(&client, host, port))
+	if (mqtt_client_connect(&client, host, port) >= 0)
 		mqtt_client_loop(&client);
     else
         printf("Client test failed\n") ;
@@ -0,0 +1,186 @@
+#ifndef mqttclient_H
+#define mqttclient_H
+
+#include "mqttparser.h"
+#ifdef WIN32
+#include <WinSock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+#define MQTT_ADDR_MAX    8
+#define MQTT_ACK_BATCH   64 // bytes of acks sent together, 4 per ack
+
+/* Resolved addresses of a broker, may be shared among clients connecting to
+   the same host from any threads: each connect works on a snapshot and
+   publishes refreshes under a sequence lock */
+typedef struct mqtt_addr_cache_s
+{
+	volatile uint32_t       seq;     // odd while a refresh is being published
+	char                    host[128];
+	char                    port[16];
+	int                     count;
+	struct sockaddr_storage addr[MQTT_ADDR_MAX];
+	int                     addrlen[MQTT_ADDR_MAX];
+	long long               expires; // ms, monotonic clock
+	int                     ttl;     // ms, set once by mqtt_addr_cache_init
+} mqtt_addr_cache_t;
+
+void mqtt_addr_cache_init(mqtt_addr_cache_t *cache, int ttl);
+
+/* Last value cache entry, open addressing with linear probing */
+typedef struct mqtt_lvc_entry_s
+{
+	uint32_t hash;
+	uint32_t blob;        // arena offset of the blob: header, topic, payload
+	uint32_t capacity;    // payload bytes the blob can hold
+	uint16_t topic_len;
+	uint16_t payload_len;
+	int32_t  prev;        // LRU list, most recently updated first
+	int32_t  next;
+	uint8_t  used;
+	uint8_t  retained;
+} mqtt_lvc_entry_t;
+
+/* Most recent payload per topic, filled by the client thread and read from
+   any thread through a sequence lock: readers never block the writer */
+typedef struct mqtt_lvc_s
+{
+	volatile uint32_t seq;    // odd while the writer is updating
+	mqtt_lvc_entry_t *entries;
+	int               mask;   // entries - 1, entries is a power of two
+	int               count;
+	int32_t           head;   // LRU list ends
+	int32_t           tail;
+	uint8_t          *arena;
+	uint32_t          arena_size;
+	uint32_t          arena_head;
+	int               retained_only;
+} mqtt_lvc_t;
+
+/* Traffic counters of a client, summed over the pool by the sharded client */
+typedef struct mqtt_client_metrics_s
+{
+	uint32_t messages_out;
+	uint32_t messages_in;
+	uint64_t bytes_out;
+	uint64_t bytes_in;
+	uint32_t connects;
+} mqtt_client_metrics_t;
+
+/* Definition os  few message handlers */
+typedef struct mqtt_client_s mqtt_client_t;
+typedef void(*mqtt_on_connect_t)(mqtt_client_t *);
+typedef void(*mqtt_on_publish_t)(mqtt_client_t *, const mqtt_text_t *topic, const mqtt_text_t *message);
+
+struct mqtt_client_s
+{
+	int                socket;
+	uint16_t           msgid;
+	uint8_t            buffer[256];
+	uint8_t            buffer_in[256];
+	uint8_t            clean;
+	uint8_t            fastopen;
+	uint8_t            validate;      // check UTF-8 and topic rules both ways
+	uint8_t            duplicate;     // the PUBLISH being dispatched may be a redelivery
+	uint16_t           keepalive;
+	uint16_t           passlen;
+	uint16_t           buffer_len;    // bytes of buffer_in waiting for the rest of their frame
+	const char        *client_id;     // CONNECT builder arguments, kept by the caller:
+	const char        *username;      // the frame is encoded at connect time
+	const char        *password;
+	mqtt_addr_cache_t *cache;
+	int                backoff_ms;    // next reconnect delay upper bound
+	int                connack_ms;    // time to CONNACK of the last connect, -1 if pending
+	long long          connect_start; // ms, when the last connect began
+	mqtt_lvc_t        *lvc;
+	mqtt_inbound_t    *inbound;       // QoS 2 receive state, survives reconnects
+	uint8_t            acks[MQTT_ACK_BATCH];
+	int                acks_size;
+	mqtt_client_metrics_t metrics;
+	mqtt_on_connect_t  on_connect;
+	mqtt_on_publish_t  on_publish;
+} ;
+
+/* Both return -1 if the CONNECT frame does not fit in the send buffer.
+   The strings are referenced, not copied, and must outlive the client */
+int  mqtt_client_init(mqtt_client_t *self, const char *client_id, int clean, uint16_t keepalive);
+int  mqtt_client_credentials(mqtt_client_t *self, const char *username, const char *password, int passlen);
+void mqtt_client_callbacks(mqtt_client_t *self, mqtt_on_connect_t on_connect, mqtt_on_publish_t on_publish);
+void mqtt_client_addr_cache(mqtt_client_t *self, mqtt_addr_cache_t *cache);
+void mqtt_client_fastopen(mqtt_client_t *self, int enable);
+void mqtt_client_validate(mqtt_client_t *self, int enable);
+void mqtt_client_lvc(mqtt_client_t *self, mqtt_lvc_t *lvc);
+void mqtt_client_inbound(mqtt_client_t *self, mqtt_inbound_t *inbound);
+
+int  mqtt_client_connect(mqtt_client_t *self, const char *host, const char *port);
+int  mqtt_client_reconnect(mqtt_client_t *self, const char *host, const char *port, int attempts);
+int  mqtt_client_send(mqtt_client_t *self, mqtt_message_t *message);
+int  mqtt_client_publish(mqtt_client_t *self, int qos, int retain, const char *topic, const char *msg, int msglen);
+int  mqtt_client_loop(mqtt_client_t *self);
+void mqtt_client_shutdown(mqtt_client_t *self);
+
+int  mqtt_client_duplicate(const mqtt_client_t *self);
+int  mqtt_client_connack_ms(const mqtt_client_t *self);
+const mqtt_client_metrics_t *mqtt_client_metrics(const mqtt_client_t *self);
+
+/* Last value cache */
+void mqtt_lvc_init(mqtt_lvc_t *self, mqtt_lvc_entry_t *entries, int count,
+	               uint8_t *arena, int size, int retained_only);
+int  mqtt_lvc_store(mqtt_lvc_t *self, const mqtt_text_t *topic, const mqtt_text_t *payload, int retained);
+int  mqtt_lvc_get(const mqtt_lvc_t *self, const char *topic, int topic_len,
+	              uint8_t *data, int size, int *retained);
+
+#define MQTT_SHARD_MAX  32 // shards of a pool, one bit each in mqtt_shard_sub_t
+#define MQTT_SHARD_SUBS 32
+
+/* Subscription held on one connection per distinct endpoint */
+typedef struct mqtt_shard_sub_s
+{
+	const char *topic;
+	int         qos;
+	uint32_t    shards; // shards it is currently subscribed through
+} mqtt_shard_sub_t;
+
+/* Pool of clients, one per endpoint (endpoints may repeat). Publishes are
+   routed by rendezvous hashing of the topic: a topic always goes through
+   the same live connection so its order is kept, and when a shard goes
+   down only its own topics move. Subscriptions are placed the same way
+   among the connections of each distinct endpoint, so that every broker
+   delivers its messages exactly once.
+   The pool is not locked: every mqtt_shards_ call, and the callbacks they
+   run, must come from one thread, the one running mqtt_shards_loop.
+   Other threads may only read shared state that has its own lock: the
+   address cache and mqtt_lvc_get */
+typedef struct mqtt_shards_s
+{
+	mqtt_client_t    *clients;
+	const char      **hosts;
+	const char      **ports;
+	int               count;
+	uint8_t           endpoint[MQTT_SHARD_MAX]; // first shard with the same host and port
+	mqtt_shard_sub_t  subs[MQTT_SHARD_SUBS];
+	int               subs_count;
+} mqtt_shards_t;
+
+/* Returns -1 if count exceeds MQTT_SHARD_MAX */
+int  mqtt_shards_init(mqtt_shards_t *self, mqtt_client_t *clients, int count, const char **hosts, const char **ports);
+void mqtt_shards_callbacks(mqtt_shards_t *self, mqtt_on_connect_t on_connect, mqtt_on_publish_t on_publish);
+int  mqtt_shards_route(const mqtt_shards_t *self, const char *topic, int topic_len);
+int  mqtt_shards_connect(mqtt_shards_t *self);
+void mqtt_shards_down(mqtt_shards_t *self, int shard);
+/* Waits up to timeout_ms (-1 for ever) for input on all live shards and
+   dispatches it; lost shards are marked down. Returns the live shard count */
+int  mqtt_shards_loop(mqtt_shards_t *self, int timeout_ms);
+int  mqtt_shards_up(mqtt_shards_t *self, int shard);
+int  mqtt_shards_publish(mqtt_shards_t *self, int qos, int retain, const char *topic, const char *msg, int msglen);
+int  mqtt_shards_subscribe(mqtt_shards_t *self, const char *topic, int qos);
+void mqtt_shards_metrics(const mqtt_shards_t *self, mqtt_client_metrics_t *metrics);
+
+/* Connects and prints incoming messages until the connection drops */
+void mqtt_client_test(const char *host, const char *port);
+
+#endif
@@ -2,6 +2,31 @@
 #include <string.h>
 #include <stdarg.h>
 
+#if defined(__x86_64__) || defined(_M_X64) || (defined(__i386__) && defined(__SSE2__)) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MQTT_SIMD_X86
+#include <immintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <intrin.h>
+#define mqtt_inline static __forceinline
+#else
+#define mqtt_inline static inline __attribute__((always_inline))
+#endif
+
+mqtt_inline int mqtt_ctz(unsigned mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
 void mqtt_packet_push_byte(mqtt_packet_t *self, uint8_t *data);
 void mqtt_packet_push_word(mqtt_packet_t *self, uint16_t *data);
 void mqtt_packet_push_length(mqtt_packet_t *self, int *data);
@@ -56,14 +81,14 @@ void mqtt_packet_init(mqtt_packet_t *self, uint8_t *data, int size)
 
 void mqtt_packet_push_byte(mqtt_packet_t *self, uint8_t *data)
 {
-	if (self->head < self->size - 1)
+	if (self->head < self->size)
 		self->data[self->head] = *data;
 	self->head++;
 }
 
 void mqtt_packet_push_word(mqtt_packet_t *self, uint16_t *data)
 {
-	if (self->head < self->size - 2)
+	if (self->head + 2 <= self->size)
 	{
 		self->data[self->head++] = (uint8_t)(*data >> 8);
 		self->data[self->head++] = (uint8_t)(*data & 0xFF);
@@ -77,8 +102,11 @@ void mqtt_packet_push_length(mqtt_packet_t *self, int *data)
 	int value = *data;
 	do
 	{
-		self->data[self->head++] = value & 0xff;
-		value /= 0x80;
+		uint8_t byte = (uint8_t)(value & 0x7f);
+		value >>= 7;
+		if (value > 0)
+			byte |= 0x80;
+		mqtt_packet_push_byte(self, &byte);
 	} while (value > 0);
 }
 
@@ -90,15 +118,14 @@ void mqtt_packet_push_text(mqtt_packet_t *self, mqtt_text_t *data)
 
 void mqtt_packet_push_message(mqtt_packet_t *self, mqtt_text_t *data)
 {
-	if (self->head + data->length <= self->size)
+	if (data->length && self->head + data->length <= self->size)
 		memcpy(self->data + self->head, data->text, data->length);
 	self->head += data->length;
 }
 
 void mqtt_packet_pop_byte(mqtt_packet_t *self, uint8_t *data)
 {
-	if (self->head < self->size - 1)
-		*data = self->data[self->head];
+	*data = self->head < self->size ? self->data[self->head] : 0;
 	self->head++;
 }
 
@@ -110,17 +137,20 @@ void mqtt_packet_pop_word(mqtt_packet_t *self, uint16_t *data)
 		*data = (*data << 8) | self->data[self->head++];
 	}
 	else
+	{
+		*data = 0;
 		self->head += 2;
+	}
 }
 
 void mqtt_packet_pop_length(mqtt_packet_t *self, int *data)
 {
 	int i;
 	int value = 0;
-	for (i = 0; i < 4; i++)
+	for (i = 0; i < 4 && self->head < self->size; i++)
 	{
 		uint8_t tmp = self->data[self->head++];
-		value = (value << 7) + (tmp & 0x7f);
+		value |= (tmp & 0x7f) << (7 * i);
 		if ((tmp & 0x80) == 0)
 			break;
 	}
@@ -131,14 +161,23 @@ void mqtt_packet_pop_text(mqtt_packet_t *self, mqtt_text_t *data)
 {
 	mqtt_packet_pop_word(self, &data->length);
 	if (self->head + data->length <= self->size)
+	{
 		data->text = self->data + self->head;
-	self->head += data->length;
+		self->head += data->length;
+	}
+	else
+	{
+		// text overruns the packet: hand back an empty text and stop reading
+		data->length = 0;
+		data->text = NULL;
+		self->head = self->size;
+	}
 }
 
 void mqtt_packet_pop_message(mqtt_packet_t *self, mqtt_text_t *data)
 {
-	data->length = (uint16_t)(self->size - self->head);
-	data->text = self->data + self->head;
+	data->length = (uint16_t)(self->head < self->size ? self->size - self->head : 0);
+	data->text = self->head <= self->size ? self->data + self->head : NULL;
 	self->head = self->size;
 }
 
@@ -169,16 +208,15 @@ void mqtt_connect_payload_exx(mqtt_packet_t *packet,
 								mqtt_exchanger_t *exx)
 {
 	exx->text_exx(packet, &data->client_id);
-	if (ctrl->flags & 0x40)
+	if (ctrl->flags & 0x04)
 	{
 		exx->text_exx(packet, &data->will_topic);
 		exx->text_exx(packet, &data->will_message);
 	}
 	if (ctrl->flags & 0x80)
-	{
 		exx->text_exx(packet, &data->username);
+	if (ctrl->flags & 0x40)
 		exx->text_exx(packet, &data->password);
-	}
 }
 
 
@@ -316,7 +354,7 @@ void mqtt_connect_will(mqtt_message_t *self, int will_retain, int will_qos,
 					   const char *will_message, int msg_len)
 {
 	mqtt_connect_payload_t *connect = &self->payload.connect;
-	self->variable.connect.flags |= (0x40 | (will_retain ? 0x20 : 0) | (will_qos << 3));
+	self->variable.connect.flags |= (0x04 | (will_retain ? 0x20 : 0) | (will_qos << 3));
 	connect->will_topic.length   = (uint16_t )topic_len;
 	connect->will_topic.text     = (uint8_t *)will_topic;
 	connect->will_message.length = (uint16_t )msg_len;
@@ -387,4 +425,1005 @@ void mqtt_subscribe_build(mqtt_message_t *self, uint16_t *msgid, const char *top
 void mqtt_unsubscribe_build(mqtt_message_t *self, uint16_t *msgid, const char *topic)
 {
 	mqtt_va_unsubscribe_build(self, msgid, topic, NULL);
-}
\ No newline at end of file
+}
+int mqtt_view_init(mqtt_view_t *self, uint8_t *data, int size)
+{
+	int i;
+	int value = 0;
+
+	self->data = data;
+	self->length = 0;
+	self->offset = 0;
+	if (size < 2)
+		return 0;
+	self->ctrl = data[0];
+	for (i = 1; i < 5; i++)
+	{
+		if (i >= size)
+			return 0;
+		value |= (data[i] & 0x7f) << (7 * (i - 1));
+		if ((data[i] & 0x80) == 0)
+			break;
+	}
+	if (i == 5)
+		return -1;
+	self->offset = i + 1;
+	self->length = value;
+	if (mqtt_view_size(self) > size)
+		return 0;
+	return mqtt_view_size(self);
+}
+
+/* Reads a big endian word at offset, -1 if outside the frame */
+static int mqtt_view_word(const mqtt_view_t *self, int offset)
+{
+	if (offset < 0 || offset + 2 > mqtt_view_size(self))
+		return -1;
+	return (self->data[offset] << 8) | self->data[offset + 1];
+}
+
+/* Offset just past the PUBLISH topic, -1 if it does not fit the frame */
+static int mqtt_view_topic_end(const mqtt_view_t *self)
+{
+	int length;
+	if (mqtt_view_type(self) != PUBLISH)
+		return -1;
+	if ((length = mqtt_view_word(self, self->offset)) < 0)
+		return -1;
+	if (self->offset + 2 + length > mqtt_view_size(self))
+		return -1;
+	return self->offset + 2 + length;
+}
+
+int mqtt_view_topic(const mqtt_view_t *self, mqtt_text_t *topic)
+{
+	int end = mqtt_view_topic_end(self);
+	if (end < 0)
+		return -1;
+	topic->text = self->data + self->offset + 2;
+	topic->length = (uint16_t)(end - self->offset - 2);
+	return topic->length;
+}
+
+int mqtt_view_packetid(const mqtt_view_t *self)
+{
+	switch (mqtt_view_type(self))
+	{
+	case PUBLISH:
+		if (mqtt_view_qos(self) == 0)
+			return -1;
+		return mqtt_view_word(self, mqtt_view_topic_end(self));
+	case PUBACK:
+	case PUBREC:
+	case PUBREL:
+	case PUBCOMP:
+	case SUBSCRIBE:
+	case SUBACK:
+	case UNSUBSCRIBE:
+	case UNSUBACK:
+		return mqtt_view_word(self, self->offset);
+	}
+	return -1;
+}
+
+int mqtt_view_payload(const mqtt_view_t *self, mqtt_text_t *payload)
+{
+	int start = mqtt_view_topic_end(self);
+	if (start < 0)
+		return -1;
+	if (mqtt_view_qos(self))
+		start += 2;
+	/* a longer payload would be cut by the 16 bit length */
+	if (start > mqtt_view_size(self) || mqtt_view_size(self) - start > 0xFFFF)
+		return -1;
+	payload->text = self->data + start;
+	payload->length = (uint16_t)(mqtt_view_size(self) - start);
+	return payload->length;
+}
+
+void mqtt_view_items(const mqtt_view_t *self, mqtt_view_iter_t *iter)
+{
+	iter->view = self;
+	iter->head = self->offset + 2; // skip packet id
+}
+
+int mqtt_view_next_item(mqtt_view_iter_t *iter, mqtt_subscribe_item_payload_t *item)
+{
+	const mqtt_view_t *view = iter->view;
+	int end = mqtt_view_size(view);
+	int length;
+
+	memset(item, 0, sizeof(mqtt_subscribe_item_payload_t));
+	switch (mqtt_view_type(view))
+	{
+	case SUBACK:
+		if (iter->head + 1 > end)
+			return 0;
+		item->ack = view->data[iter->head++];
+		return 1;
+	case SUBSCRIBE:
+	case UNSUBSCRIBE:
+		if ((length = mqtt_view_word(view, iter->head)) < 0)
+			return 0;
+		if (iter->head + 2 + length > end)
+			return 0;
+		item->topic.text = view->data + iter->head + 2;
+		item->topic.length = (uint16_t)length;
+		iter->head += 2 + length;
+		if (mqtt_view_type(view) == SUBSCRIBE)
+		{
+			if (iter->head + 1 > end)
+				return 0;
+			item->qos = view->data[iter->head++];
+		}
+		return 1;
+	}
+	return 0;
+}
+
+static int mqtt_compact_header_read(mqtt_compact_header_t *self, mqtt_view_t *view, uint8_t *data, int size, int cmd)
+{
+	if (mqtt_view_init(view, data, size) <= 0 || mqtt_view_size(view) > 0xFFFF)
+		return -1;
+	if (cmd && mqtt_view_type(view) != cmd)
+		return -1;
+	self->ctrl = view->ctrl;
+	self->offset = (uint8_t)view->offset;
+	self->length = (uint16_t)view->length;
+	return 0;
+}
+
+/* Reads a length prefixed string at *head into span */
+static int mqtt_compact_span_read(mqtt_span_t *span, const mqtt_view_t *view, int *head)
+{
+	int length = mqtt_view_word(view, *head);
+	if (length < 0 || *head + 2 + length > mqtt_view_size(view))
+		return -1;
+	span->offset = (uint16_t)(*head + 2);
+	span->length = (uint16_t)length;
+	*head += 2 + length;
+	return 0;
+}
+
+int mqtt_compact_connect_read(mqtt_compact_connect_t *self, uint8_t *data, int size)
+{
+	mqtt_view_t view;
+	mqtt_span_t marker;
+	int head;
+
+	memset(self, 0, sizeof(mqtt_compact_connect_t));
+	if (mqtt_compact_header_read(&self->header, &view, data, size, CONNECT) < 0)
+		return -1;
+	head = view.offset;
+	if (mqtt_compact_span_read(&marker, &view, &head) < 0 || head + 4 > mqtt_view_size(&view))
+		return -1;
+	self->level = data[head++];
+	self->flags = data[head++];
+	self->keepalive = (uint16_t)mqtt_view_word(&view, head);
+	head += 2;
+	if (mqtt_compact_span_read(&self->client_id, &view, &head) < 0)
+		return -1;
+	if (self->flags & 0x04)
+	{
+		if (mqtt_compact_span_read(&self->will_topic, &view, &head) < 0 ||
+			mqtt_compact_span_read(&self->will_message, &view, &head) < 0)
+			return -1;
+	}
+	if ((self->flags & 0x80) && mqtt_compact_span_read(&self->username, &view, &head) < 0)
+		return -1;
+	if ((self->flags & 0x40) && mqtt_compact_span_read(&self->password, &view, &head) < 0)
+		return -1;
+	return 0;
+}
+
+int mqtt_compact_publish_read(mqtt_compact_publish_t *self, uint8_t *data, int size)
+{
+	mqtt_view_t view;
+	int head;
+
+	if (mqtt_compact_header_read(&self->header, &view, data, size, PUBLISH) < 0)
+		return -1;
+	head = view.offset;
+	if (mqtt_compact_span_read(&self->topic, &view, &head) < 0)
+		return -1;
+	self->packetid = 0;
+	if (mqtt_view_qos(&view))
+	{
+		int packetid = mqtt_view_word(&view, head);
+		if (packetid < 0)
+			return -1;
+		self->packetid = (uint16_t)packetid;
+		head += 2;
+	}
+	self->payload.offset = (uint16_t)head;
+	self->payload.length = (uint16_t)(mqtt_view_size(&view) - head);
+	return 0;
+}
+
+int mqtt_compact_ack_read(mqtt_compact_ack_t *self, uint8_t *data, int size)
+{
+	mqtt_view_t view;
+	int msgid;
+
+	if (mqtt_compact_header_read(&self->header, &view, data, size, 0) < 0)
+		return -1;
+	switch (mqtt_view_type(&view))
+	{
+	case CONNACK:
+	case PUBACK:
+	case PUBREC:
+	case PUBREL:
+	case PUBCOMP:
+	case UNSUBACK:
+		if ((msgid = mqtt_view_word(&view, view.offset)) < 0)
+			return -1;
+		self->msgid = (uint16_t)msgid;
+		return 0;
+	}
+	return -1;
+}
+
+int mqtt_compact_subscribe_read(mqtt_compact_subscribe_t *self, uint8_t *data, int size)
+{
+	mqtt_view_t view;
+	mqtt_view_iter_t iter;
+	mqtt_subscribe_item_payload_t item;
+	int msgid;
+
+	if (mqtt_compact_header_read(&self->header, &view, data, size, 0) < 0)
+		return -1;
+	switch (mqtt_view_type(&view))
+	{
+	case SUBSCRIBE:
+	case UNSUBSCRIBE:
+	case SUBACK:
+		break;
+	default:
+		return -1;
+	}
+	if ((msgid = mqtt_view_word(&view, view.offset)) < 0)
+		return -1;
+	self->msgid = (uint16_t)msgid;
+	self->count = 0;
+	mqtt_view_items(&view, &iter);
+	while (mqtt_view_next_item(&iter, &item))
+		self->count++;
+	return 0;
+}
+
+void mqtt_compact_items(const mqtt_compact_subscribe_t *self, uint8_t *data, mqtt_view_t *view, mqtt_view_iter_t *iter)
+{
+	view->data = data;
+	view->ctrl = self->header.ctrl;
+	view->offset = self->header.offset;
+	view->length = self->header.length;
+	mqtt_view_items(view, iter);
+}
+
+void mqtt_compact_text(mqtt_text_t *text, uint8_t *data, mqtt_span_t span)
+{
+	text->text = data + span.offset;
+	text->length = span.length;
+}
+
+void mqtt_inbound_init(mqtt_inbound_t *self)
+{
+	memset(self, 0, sizeof(mqtt_inbound_t));
+}
+
+#define mqtt_inbound_test(self, id)  ((self)->delivered[(id) >> 5] & (1u << ((id) & 31)))
+#define mqtt_inbound_set(self, id)   ((self)->delivered[(id) >> 5] |= (1u << ((id) & 31)))
+#define mqtt_inbound_clear(self, id) ((self)->delivered[(id) >> 5] &= ~(1u << ((id) & 31)))
+
+int mqtt_inbound_receive(mqtt_inbound_t *self, uint8_t ctrl, uint16_t packetid, mqtt_message_t *ack)
+{
+	int qos = (ctrl >> 1) & 0x03;
+
+	ack->header.ctrl = 0;
+	switch (ctrl >> 4)
+	{
+	case PUBLISH:
+		if (qos == 0)
+			return MQTT_INBOUND_DELIVER;
+		if (qos == 1)
+		{
+			/* ids are reused as soon as PUBACK is sent, a duplicate cannot
+			   be told from a new message: hand it over, flagged */
+			mqtt_pub_xxx_build(ack, PUBACK, packetid);
+			return (ctrl & 0x08) ? MQTT_INBOUND_DUPLICATE : MQTT_INBOUND_DELIVER;
+		}
+		/* QoS 2: any PUBLISH before PUBREL is a retransmission */
+		mqtt_pub_xxx_build(ack, PUBREC, packetid);
+		if (mqtt_inbound_test(self, packetid))
+			return MQTT_INBOUND_DROP;
+		mqtt_inbound_set(self, packetid);
+		return MQTT_INBOUND_DELIVER;
+	case PUBREL:
+		mqtt_inbound_clear(self, packetid);
+		mqtt_pub_xxx_build(ack, PUBCOMP, packetid);
+		return MQTT_INBOUND_DROP;
+	}
+	return MQTT_INBOUND_DROP;
+}
+
+/* Set ids are stored as deltas from the previous one, 7 bits per byte */
+int mqtt_inbound_save(const mqtt_inbound_t *self, uint8_t *data, int size)
+{
+	int word, head = 0, prev = -1;
+	for (word = 0; word < 65536 / 32; word++)
+	{
+		uint32_t bits = self->delivered[word];
+		int bit;
+		if (bits == 0)
+			continue;
+		for (bit = 0; bit < 32; bit++)
+		{
+			int delta;
+			if ((bits & (1u << bit)) == 0)
+				continue;
+			delta = word * 32 + bit - prev;
+			prev = word * 32 + bit;
+			do
+			{
+				uint8_t byte = (uint8_t)((delta & 0x7f) | (delta > 0x7f ? 0x80 : 0));
+				if (head < size)
+					data[head] = byte;
+				head++;
+				delta >>= 7;
+			} while (delta > 0);
+		}
+	}
+	return head;
+}
+
+int mqtt_inbound_load(mqtt_inbound_t *self, const uint8_t *data, int size)
+{
+	int head = 0, id = -1;
+	mqtt_inbound_init(self);
+	while (head < size)
+	{
+		int delta = 0, shift = 0;
+		do
+		{
+			if (head >= size || shift > 14)
+				return -1;
+			delta |= (data[head] & 0x7f) << shift;
+			shift += 7;
+		} while (data[head++] & 0x80);
+		id += delta;
+		if (delta == 0 || id > 0xFFFF)
+			return -1;
+		mqtt_inbound_set(self, id);
+	}
+	return 0;
+}
+
+/* Validation: a vector pass skips plain ASCII (and, for topics, wildcards)
+   and stops at the first byte needing attention, which is then handled by
+   scalar code. Topics are mostly ASCII so the scalar part is rarely hit */
+enum mqtt_text_kind_e
+{
+	MQTT_KIND_NONE = -1, // binary field, not checked
+	MQTT_KIND_TEXT,
+	MQTT_KIND_TOPIC,
+	MQTT_KIND_FILTER,
+};
+
+/* Bytes stopping the scan: bit 0 for any text, bit 1 for topics (wildcards).
+   U+0000 and non ASCII bytes stop both, '#' and '+' only topics */
+static const uint8_t mqtt_scan_stop[256] =
+{
+	3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 2, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+	3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+	3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+	3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+	3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+	3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+	3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+	3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+};
+
+/* Number of leading bytes that are ASCII, not U+0000 and not wildcards if asked */
+static int mqtt_scan_scalar(const uint8_t *text, int length, int wildcards)
+{
+	int stop = wildcards ? 2 : 1;
+	int i;
+	for (i = 0; i < length; i++)
+		if (mqtt_scan_stop[text[i]] & stop)
+			break;
+	return i;
+}
+
+#ifdef MQTT_SIMD_X86
+/* Stop mask of 16 bytes: high bit of a byte is either non ASCII or a match */
+mqtt_inline unsigned mqtt_scan_chunk(__m128i chunk, int wildcards)
+{
+	__m128i stop = _mm_cmpeq_epi8(chunk, _mm_setzero_si128());
+	if (wildcards)
+		stop = _mm_or_si128(stop, _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('+')),
+			                                   _mm_cmpeq_epi8(chunk, _mm_set1_epi8('#'))));
+	return (unsigned)_mm_movemask_epi8(_mm_or_si128(chunk, stop));
+}
+
+mqtt_inline unsigned mqtt_scan16(const uint8_t *text, int wildcards)
+{
+	return mqtt_scan_chunk(_mm_loadu_si128((const __m128i *)text), wildcards);
+}
+
+/* 4 to 15 bytes as two overlapping halves of one chunk, never reading past
+   the text; unused lanes are filled with a plain letter */
+mqtt_inline unsigned mqtt_scan_short(const uint8_t *text, int length, int wildcards)
+{
+	__m128i chunk;
+	if (length >= 8)
+		chunk = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)text),
+			                       _mm_loadl_epi64((const __m128i *)(text + length - 8)));
+	else
+	{
+		int32_t low, high;
+		memcpy(&low, text, 4);
+		memcpy(&high, text + length - 4, 4);
+		chunk = _mm_set_epi32(0x61616161, 0x61616161, high, low);
+	}
+	return mqtt_scan_chunk(chunk, wildcards);
+}
+
+/* Scans from i to the end 16 bytes at a time, the last chunk overlaps the
+   bytes already checked so no scalar tail is needed */
+mqtt_inline int mqtt_scan_tail16(const uint8_t *text, int i, int length, int wildcards)
+{
+	unsigned mask;
+	if (length < 16)
+		return mqtt_scan_scalar(text, length, wildcards);
+	for (; i + 16 <= length; i += 16)
+		if ((mask = mqtt_scan16(text + i, wildcards)) != 0)
+			return i + mqtt_ctz(mask);
+	if (i == length)
+		return i;
+	if ((mask = mqtt_scan16(text + length - 16, wildcards)) != 0)
+		return length - 16 + mqtt_ctz(mask);
+	return length;
+}
+
+static int mqtt_scan_sse2(const uint8_t *text, int length, int wildcards)
+{
+	return mqtt_scan_tail16(text, 0, length, wildcards);
+}
+
+#ifndef _MSC_VER
+__attribute__((target("avx2")))
+#endif
+static int mqtt_scan_avx2(const uint8_t *text, int length, int wildcards)
+{
+	int i;
+	for (i = 0; i + 32 <= length; i += 32)
+	{
+		__m256i chunk = _mm256_loadu_si256((const __m256i *)(text + i));
+		__m256i stop = _mm256_cmpeq_epi8(chunk, _mm256_setzero_si256());
+		unsigned mask;
+		if (wildcards)
+			stop = _mm256_or_si256(stop, _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('+')),
+				                                         _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('#'))));
+		mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(chunk, stop));
+		if (mask)
+			return i + mqtt_ctz(mask);
+	}
+	return mqtt_scan_tail16(text, i, length, wildcards);
+}
+
+#ifdef _MSC_VER
+/* CPU features are probed once, whichever thread validates first */
+static INIT_ONCE mqtt_cpu_once = INIT_ONCE_STATIC_INIT;
+static int mqtt_cpu_has_avx2;
+
+static BOOL CALLBACK mqtt_cpu_probe(PINIT_ONCE once, PVOID param, PVOID *context)
+{
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return TRUE;
+	__cpuid(info, 1);
+	if ((info[2] & (1 << 27)) == 0 || (_xgetbv(0) & 6) != 6) // OS saves YMM
+		return TRUE;
+	__cpuidex(info, 7, 0);
+	mqtt_cpu_has_avx2 = (info[1] & (1 << 5)) != 0;
+	return TRUE;
+}
+
+mqtt_inline int mqtt_cpu_avx2(void)
+{
+	InitOnceExecuteOnce(&mqtt_cpu_once, mqtt_cpu_probe, NULL, NULL);
+	return mqtt_cpu_has_avx2;
+}
+#else
+/* libgcc fills the CPU model in a constructor, before main: reading it is a load and a test */
+#define mqtt_cpu_avx2() __builtin_cpu_supports("avx2")
+#endif
+#endif
+
+/* Widest implementation the CPU supports. Most topics are short: up to 64
+   bytes they are checked inline with SSE2, without a call or a CPU feature
+   test, and the masks are merged so the clean case takes one branch. The
+   position of a stop byte is only looked for once one is known to exist */
+mqtt_inline int mqtt_scan(const uint8_t *text, int length, int wildcards)
+{
+#ifdef MQTT_SIMD_X86
+	if (length < 4)
+		return mqtt_scan_scalar(text, length, wildcards);
+	if (length < 16)
+		return mqtt_scan_short(text, length, wildcards) ? mqtt_scan_scalar(text, length, wildcards) : length;
+	if (length <= 64)
+	{
+		unsigned mask = mqtt_scan16(text + length - 16, wildcards);
+		int i;
+		for (i = 0; i + 16 < length; i += 16)
+			mask |= mqtt_scan16(text + i, wildcards);
+		return mask ? mqtt_scan_tail16(text, 0, length, wildcards) : length;
+	}
+	if (mqtt_cpu_avx2())
+		return mqtt_scan_avx2(text, length, wildcards);
+	return mqtt_scan_sse2(text, length, wildcards);
+#else
+	return mqtt_scan_scalar(text, length, wildcards);
+#endif
+}
+
+/* Length of the UTF-8 sequence at text, 0 if malformed (RFC 3629 table) */
+static int mqtt_utf8_sequence(const uint8_t *text, int length)
+{
+	uint8_t c = text[0];
+	uint8_t low = 0x80, high = 0xBF;
+	int size, i;
+
+	if (c < 0xC2 || c > 0xF4)
+		return 0;
+	size = c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+	if (size > length)
+		return 0;
+	if (c == 0xE0)
+		low = 0xA0;
+	else if (c == 0xED)
+		high = 0x9F; // surrogates
+	else if (c == 0xF0)
+		low = 0x90;
+	else if (c == 0xF4)
+		high = 0x8F;
+	if (text[1] < low || text[1] > high)
+		return 0;
+	for (i = 2; i < size; i++)
+		if ((text[i] & 0xC0) != 0x80)
+			return 0;
+	return size;
+}
+
+/* Handles the bytes the vector scan stops at, starting from i */
+static int mqtt_text_check_slow(const uint8_t *text, int i, int length, int kind)
+{
+	for (;;)
+	{
+		uint8_t c;
+		if (i >= length)
+			return MQTT_VALID;
+		c = text[i];
+		if (c == 0)
+			return MQTT_INVALID_NULL;
+		if (c == '+' || c == '#')
+		{
+			/* wildcards fill a whole level, '#' only the last one */
+			if (kind == MQTT_KIND_TOPIC)
+				return MQTT_INVALID_TOPIC;
+			if (i > 0 && text[i - 1] != '/')
+				return MQTT_INVALID_FILTER;
+			if (c == '#' ? i != length - 1 : (i + 1 < length && text[i + 1] != '/'))
+				return MQTT_INVALID_FILTER;
+			i++;
+		}
+		else
+		{
+			int size = mqtt_utf8_sequence(text + i, length - i);
+			if (size == 0)
+				return MQTT_INVALID_UTF8;
+			i += size;
+		}
+		i += mqtt_scan(text + i, length - i, kind != MQTT_KIND_TEXT);
+	}
+}
+
+mqtt_inline int mqtt_text_check(const uint8_t *text, int length, int kind)
+{
+	int i;
+	if (kind != MQTT_KIND_TEXT && length == 0)
+		return kind == MQTT_KIND_TOPIC ? MQTT_INVALID_TOPIC : MQTT_INVALID_FILTER;
+	i = mqtt_scan(text, length, kind != MQTT_KIND_TEXT);
+	if (i == length)
+		return MQTT_VALID; // plain ASCII, the common case
+	return mqtt_text_check_slow(text, i, length, kind);
+}
+
+int mqtt_text_validate(const mqtt_text_t *self)
+{
+	return mqtt_text_check(self->text, self->length, MQTT_KIND_TEXT);
+}
+
+int mqtt_topic_validate(const mqtt_text_t *self)
+{
+	return mqtt_text_check(self->text, self->length, MQTT_KIND_TOPIC);
+}
+
+int mqtt_filter_validate(const mqtt_text_t *self)
+{
+	return mqtt_text_check(self->text, self->length, MQTT_KIND_FILTER);
+}
+
+int mqtt_message_validate(const mqtt_message_t *data)
+{
+	int cmd = data->header.ctrl >> 4;
+	int result = MQTT_VALID;
+	int i;
+
+	switch (cmd)
+	{
+	case CONNECT:
+		result = mqtt_text_validate(&data->payload.connect.client_id);
+		if (result == MQTT_VALID && (data->variable.connect.flags & 0x04))
+			result = mqtt_topic_validate(&data->payload.connect.will_topic);
+		if (result == MQTT_VALID && (data->variable.connect.flags & 0x80))
+			result = mqtt_text_validate(&data->payload.connect.username);
+		break;
+	case PUBLISH:
+		result = mqtt_topic_validate(&data->variable.publish.topic);
+		break;
+	case SUBSCRIBE:
+	case UNSUBSCRIBE:
+		for (i = 0; i < data->payload.subscribe.count && i < MAX_SUBSCRIBE_ITEMS && result == MQTT_VALID; i++)
+			result = mqtt_filter_validate(&data->payload.subscribe.items[i].topic);
+		break;
+	}
+	return result;
+}
+
+void mqtt_frames_init(mqtt_frames_t *self, mqtt_frame_t *items, int max)
+{
+	memset(self, 0, sizeof(mqtt_frames_t));
+	self->items = items;
+	self->max = max;
+}
+
+/* Decodes the remaining length at data, 4 bytes must be readable. Returns
+   the number of length bytes or 0 if malformed: the continuation bits are
+   turned into a mask instead of being tested one byte at a time */
+static int mqtt_frames_length4(const uint8_t *data, int *length)
+{
+	uint32_t word = (uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+		            ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+	uint32_t ends = ~word & 0x80808080u;
+	uint32_t value;
+	int bytes;
+
+	if (ends == 0)
+		return 0;
+	bytes = (mqtt_ctz(ends) >> 3) + 1;
+	value = (word & 0x7fu) | ((word >> 1) & 0x3f80u) | ((word >> 2) & 0x1fc000u) | ((word >> 3) & 0xfe00000u);
+	*length = (int)(value & ((1u << (7 * bytes)) - 1));
+	return bytes;
+}
+
+/* Same near the end of the buffer, -1 if more data is needed */
+static int mqtt_frames_length(const uint8_t *data, int size, int *length)
+{
+	int i, value = 0;
+	for (i = 0; i < 4 && i < size; i++)
+	{
+		value |= (data[i] & 0x7f) << (7 * i);
+		if ((data[i] & 0x80) == 0)
+		{
+			*length = value;
+			return i + 1;
+		}
+	}
+	return i == 4 ? 0 : -1;
+}
+
+int mqtt_frames_scan(mqtt_frames_t *self, const uint8_t *data, int size)
+{
+	mqtt_frame_t *frame = self->items;
+	mqtt_frame_t *end = self->items + self->max;
+	int counts[4] = { 0, 0, 0, 0 }; // index 3 collects invalid QoS 3
+	int head = 0;
+
+	self->malformed = 0;
+	/* fast path: the whole length field is readable */
+	while (frame < end && head + 5 <= size)
+	{
+		uint8_t ctrl = data[head];
+		int length, bytes = mqtt_frames_length4(data + head + 1, &length);
+		if (bytes == 0)
+		{
+			self->malformed = 1;
+			break;
+		}
+		if (length > size - head - 1 - bytes)
+			break; // partial frame
+		frame->ctrl = ctrl;
+		frame->header = (uint8_t)(1 + bytes);
+		frame->offset = head;
+		frame->length = 1 + bytes + length;
+		counts[(ctrl >> 1) & 0x03] += (ctrl >> 4) == PUBLISH;
+		head += frame->length;
+		frame++;
+	}
+	/* tail: short frames at the very end of the buffer */
+	while (frame < end && !self->malformed && head + 2 <= size)
+	{
+		uint8_t ctrl = data[head];
+		int length, bytes = mqtt_frames_length(data + head + 1, size - head - 1, &length);
+		if (bytes < 0 || (bytes > 0 && length > size - head - 1 - bytes))
+			break;
+		if (bytes == 0)
+		{
+			self->malformed = 1;
+			break;
+		}
+		frame->ctrl = ctrl;
+		frame->header = (uint8_t)(1 + bytes);
+		frame->offset = head;
+		frame->length = 1 + bytes + length;
+		counts[(ctrl >> 1) & 0x03] += (ctrl >> 4) == PUBLISH;
+		head += frame->length;
+		frame++;
+	}
+	self->count = (int)(frame - self->items);
+	self->consumed = head;
+	self->qos[0] = counts[0];
+	self->qos[1] = counts[1];
+	self->qos[2] = counts[2];
+	return self->count;
+}
+
+void mqtt_frame_view(const mqtt_frame_t *self, uint8_t *data, mqtt_view_t *view)
+{
+	view->data = data + self->offset;
+	view->ctrl = self->ctrl;
+	view->offset = self->header;
+	view->length = self->length - self->header;
+}
+
+/* Checked decoder: every field group is validated against the frame end
+   with a single comparison before its bytes are read */
+#define mqtt_word_at(data, head) (uint16_t)(((data)[head] << 8) | (data)[(head) + 1])
+
+/* Reads a length prefixed string plus extra fixed bytes following it */
+mqtt_inline int mqtt_checked_text(const uint8_t *data, int *head, int end, int extra, mqtt_text_t *text)
+{
+	int length;
+	if (*head + 2 > end)
+		return -1;
+	length = mqtt_word_at(data, *head);
+	if (*head + 2 + length + extra > end)
+		return -1;
+	text->length = (uint16_t)length;
+	text->text = (uint8_t *)data + *head + 2;
+	*head += 2 + length;
+	return 0;
+}
+
+/* Same, then checks the text while it is still in cache when validating
+   (kind is MQTT_KIND_NONE otherwise); head is left at an invalid field */
+mqtt_inline int mqtt_checked_field(const uint8_t *data, int *head, int end, int extra, mqtt_text_t *text, int kind)
+{
+	int start = *head, result;
+	if (mqtt_checked_text(data, head, end, extra, text) < 0)
+		return MQTT_ERROR_TRUNCATED;
+	if (kind == MQTT_KIND_NONE || (result = mqtt_text_check(text->text, text->length, kind)) == MQTT_VALID)
+		return MQTT_OK;
+	*head = start;
+	return result;
+}
+
+#define mqtt_checked_kind(validate, kind) ((validate) ? (kind) : MQTT_KIND_NONE)
+
+static int mqtt_checked_connect(mqtt_message_t *msg, const uint8_t *data, int *head, int end, int validate)
+{
+	mqtt_connect_variable_t *variable = &msg->variable.connect;
+	mqtt_connect_payload_t *payload = &msg->payload.connect;
+	int result;
+
+	/* marker, then level, flags and keepalive in one group */
+	if (mqtt_checked_text(data, head, end, 4, &variable->marker) < 0)
+		return MQTT_ERROR_TRUNCATED;
+	variable->level = data[*head];
+	variable->flags = data[*head + 1];
+	variable->keepalive = mqtt_word_at(data, *head + 2);
+	*head += 4;
+	if ((result = mqtt_checked_field(data, head, end, 0, &payload->client_id, mqtt_checked_kind(validate, MQTT_KIND_TEXT))) != MQTT_OK)
+		return result;
+	if (variable->flags & 0x04)
+	{
+		if ((result = mqtt_checked_field(data, head, end, 0, &payload->will_topic, mqtt_checked_kind(validate, MQTT_KIND_TOPIC))) != MQTT_OK ||
+			(result = mqtt_checked_field(data, head, end, 0, &payload->will_message, MQTT_KIND_NONE)) != MQTT_OK)
+			return result;
+	}
+	if ((variable->flags & 0x80) &&
+		(result = mqtt_checked_field(data, head, end, 0, &payload->username, mqtt_checked_kind(validate, MQTT_KIND_TEXT))) != MQTT_OK)
+		return result;
+	if ((variable->flags & 0x40) &&
+		(result = mqtt_checked_field(data, head, end, 0, &payload->password, MQTT_KIND_NONE)) != MQTT_OK)
+		return result;
+	return MQTT_OK;
+}
+
+static int mqtt_checked_subscribe(mqtt_message_t *msg, int cmd, const uint8_t *data, int *head, int end, int validate)
+{
+	int kind = mqtt_checked_kind(validate, MQTT_KIND_FILTER);
+	int result;
+	mqtt_subscribe_payload_t *subs = &msg->payload.subscribe;
+	for (subs->count = 0; *head < end; subs->count++)
+	{
+		mqtt_subscribe_item_payload_t *item;
+		if (subs->count == MAX_SUBSCRIBE_ITEMS)
+			return MQTT_ERROR_ITEMS;
+		item = &subs->items[subs->count];
+		switch (cmd)
+		{
+		case SUBSCRIBE:
+			if ((result = mqtt_checked_field(data, head, end, 1, &item->topic, kind)) != MQTT_OK)
+				return result;
+			item->qos = data[(*head)++];
+			break;
+		case UNSUBSCRIBE:
+			if ((result = mqtt_checked_field(data, head, end, 0, &item->topic, kind)) != MQTT_OK)
+				return result;
+			break;
+		case SUBACK:
+			item->ack = data[(*head)++];
+			break;
+		}
+	}
+	return MQTT_OK;
+}
+
+/* Fixed header; head is left past it or at the failing byte */
+mqtt_inline int mqtt_checked_header(mqtt_message_t *msg, const uint8_t *data, int size, int *head)
+{
+	int i, length = 0;
+
+	*head = 0;
+	if (size < 2)
+		return MQTT_ERROR_SHORT;
+	msg->header.ctrl = data[0];
+	for (i = 1; i < 5; i++)
+	{
+		*head = i;
+		if (i >= size)
+			return MQTT_ERROR_SHORT;
+		length |= (data[i] & 0x7f) << (7 * (i - 1));
+		if ((data[i] & 0x80) == 0)
+			break;
+	}
+	if (i == 5)
+		return MQTT_ERROR_LENGTH;
+	msg->header.length = length;
+	*head = i + 1;
+	if (length > size - *head)
+	{
+		*head = size;
+		return MQTT_ERROR_SHORT;
+	}
+	return MQTT_OK;
+}
+
+/* Shared by the checked readers: text fields are validated as they are
+   decoded, in the same pass, instead of walking the message again */
+mqtt_inline int mqtt_message_decode(mqtt_message_t *msg, mqtt_packet_t *packet, int *error_pos, int validate)
+{
+	const uint8_t *data = packet->data + packet->head;
+	int head, end, cmd;
+	int result = mqtt_checked_header(msg, data, packet->size - packet->head, &head);
+
+	if (result != MQTT_OK)
+	{
+		if (error_pos)
+			*error_pos = packet->head + head;
+		return result;
+	}
+	end = head + msg->header.length;
+
+	cmd = msg->header.ctrl >> 4;
+	switch (cmd)
+	{
+	case CONNECT:
+		result = mqtt_checked_connect(msg, data, &head, end, validate);
+		break;
+	case PUBLISH:
+		if (((msg->header.ctrl >> 1) & 0x03) == 3)
+		{
+			result = MQTT_ERROR_QOS;
+			break;
+		}
+		/* topic and packet id in one group */
+		result = mqtt_checked_field(data, &head, end, (msg->header.ctrl & 0x06) ? 2 : 0,
+			                        &msg->variable.publish.topic, mqtt_checked_kind(validate, MQTT_KIND_TOPIC));
+		if (result != MQTT_OK)
+			break;
+		msg->variable.publish.packetid = 0;
+		if (msg->header.ctrl & 0x06)
+		{
+			msg->variable.publish.packetid = mqtt_word_at(data, head);
+			head += 2;
+		}
+		if (end - head > 0xFFFF)
+		{
+			result = MQTT_ERROR_SIZE;
+			break;
+		}
+		msg->payload.publish.text = (uint8_t *)data + head;
+		msg->payload.publish.length = (uint16_t)(end - head);
+		head = end;
+		break;
+	case CONNACK:
+		if (head + 2 > end)
+		{
+			result = MQTT_ERROR_TRUNCATED;
+			break;
+		}
+		msg->variable.connack.byte1 = data[head];
+		msg->variable.connack.byte2 = data[head + 1];
+		head += 2;
+		break;
+	case SUBSCRIBE:
+	case UNSUBSCRIBE:
+	case SUBACK:
+		if (head + 2 > end)
+		{
+			result = MQTT_ERROR_TRUNCATED;
+			break;
+		}
+		msg->variable.msgid = mqtt_word_at(data, head);
+		head += 2;
+		result = mqtt_checked_subscribe(msg, cmd, data, &head, end, validate);
+		break;
+	case PUBACK:
+	case PUBREC:
+	case PUBREL:
+	case PUBCOMP:
+	case UNSUBACK:
+		if (head + 2 > end)
+		{
+			result = MQTT_ERROR_TRUNCATED;
+			break;
+		}
+		msg->variable.msgid = mqtt_word_at(data, head);
+		head += 2;
+		break;
+	case PINGREQ:
+	case PINGRESP:
+	case DISCONNECT:
+		break;
+	default:
+		result = MQTT_ERROR_TYPE;
+		break;
+	}
+	if (error_pos)
+		*error_pos = packet->head + head;
+	if (result == MQTT_OK)
+		packet->head += end;
+	return result;
+}
+
+int mqtt_message_read_checked(mqtt_message_t *msg, mqtt_packet_t *packet, int *error_pos)
+{
+	return mqtt_message_decode(msg, packet, error_pos, 0);
+}
+
+int mqtt_message_read_valid(mqtt_message_t *msg, mqtt_packet_t *packet, int *error_pos)
+{
+	return mqtt_message_decode(msg, packet, error_pos, 1);
+}
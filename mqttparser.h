@@ -139,4 +139,188 @@ void mqtt_message_read(mqtt_message_t *data, mqtt_packet_t *packet);
 void mqtt_message_write(mqtt_message_t *data,mqtt_packet_t *packet);
 int mqtt_message_peek(mqtt_message_t *data, mqtt_packet_t *packet);
 
+/* Results of the checked decoder */
+enum mqtt_result_e
+{
+	MQTT_OK = 0,
+	MQTT_ERROR_SHORT,     // buffer ends before the frame does
+	MQTT_ERROR_LENGTH,    // remaining length longer than 4 bytes
+	MQTT_ERROR_TYPE,      // reserved control packet type
+	MQTT_ERROR_QOS,       // PUBLISH with QoS 3
+	MQTT_ERROR_TRUNCATED, // a field runs past the remaining length
+	MQTT_ERROR_ITEMS,     // more than MAX_SUBSCRIBE_ITEMS items, the first ones are decoded
+	MQTT_ERROR_SIZE,      // PUBLISH payload longer than a mqtt_text_t can hold
+};
+
+/* Decodes one frame at packet->head without ever reading outside the packet.
+   On success head moves past the frame; *error_pos is the offset where
+   decoding stopped, the failing field on error (error_pos may be NULL) */
+int mqtt_message_read_checked(mqtt_message_t *data, mqtt_packet_t *packet, int *error_pos);
+
+/* Validation results, numbered apart from mqtt_result_e so that
+   mqtt_message_read_valid can return either */
+enum mqtt_valid_e
+{
+	MQTT_VALID = 0,
+	MQTT_INVALID_UTF8 = 0x10, // malformed UTF-8
+	MQTT_INVALID_NULL,   // U+0000
+	MQTT_INVALID_TOPIC,  // empty or wildcard in a topic name
+	MQTT_INVALID_FILTER, // empty or misplaced wildcard in a topic filter
+};
+
+int mqtt_text_validate(const mqtt_text_t *);
+int mqtt_topic_validate(const mqtt_text_t *);
+int mqtt_filter_validate(const mqtt_text_t *);
+/* Checks every text field of a built or decoded message. Builders do not
+   validate: mqtt_client_send does it when validation is enabled */
+int mqtt_message_validate(const mqtt_message_t *);
+/* mqtt_message_read_checked that also validates text fields in the same
+   pass: returns MQTT_OK, a mqtt_result_e error or a mqtt_valid_e error,
+   *error_pos is then the start of the invalid field */
+int mqtt_message_read_valid(mqtt_message_t *data, mqtt_packet_t *packet, int *error_pos);
+
+/* Read only view over a received frame. Only the fixed header is decoded by
+   mqtt_view_init, other fields are decoded on demand and point into the frame */
+typedef struct mqtt_view_s
+{
+	uint8_t *data;   // start of the frame
+	uint8_t  ctrl;
+	int      length; // remaining length
+	int      offset; // start of variable header
+} mqtt_view_t;
+
+/* Iterator over SUBSCRIBE/UNSUBSCRIBE/SUBACK items */
+typedef struct mqtt_view_iter_s
+{
+	const mqtt_view_t *view;
+	int                head;
+} mqtt_view_iter_t;
+
+#define mqtt_view_type(view) ((view)->ctrl >> 4)
+#define mqtt_view_qos(view)  (((view)->ctrl >> 1) & 0x03)
+#define mqtt_view_size(view) ((view)->offset + (view)->length)
+
+/* Returns the frame size, 0 if more data is needed or -1 if the length is malformed */
+int  mqtt_view_init(mqtt_view_t *, uint8_t *data, int size);
+/* Accessors return -1 when the field is not present in the frame */
+int  mqtt_view_topic(const mqtt_view_t *, mqtt_text_t *topic);
+int  mqtt_view_packetid(const mqtt_view_t *);
+/* -1 as well when the payload is longer than a mqtt_text_t can hold */
+int  mqtt_view_payload(const mqtt_view_t *, mqtt_text_t *payload);
+void mqtt_view_items(const mqtt_view_t *, mqtt_view_iter_t *iter);
+int  mqtt_view_next_item(mqtt_view_iter_t *iter, mqtt_subscribe_item_payload_t *item);
+
+/* Frame descriptor produced by the batch scanner */
+typedef struct mqtt_frame_s
+{
+	uint8_t ctrl;
+	uint8_t header; // fixed header size
+	int     offset; // frame start in the buffer
+	int     length; // whole frame size
+} mqtt_frame_t;
+
+/* Result of a batch scan over a receive buffer */
+typedef struct mqtt_frames_s
+{
+	mqtt_frame_t *items;
+	int           max;
+	int           count;
+	int           consumed;  // bytes covered by items, the rest is a partial frame
+	int           malformed; // scan stopped on a bad remaining length
+	int           qos[3];    // PUBLISH frames per QoS
+} mqtt_frames_t;
+
+void mqtt_frames_init(mqtt_frames_t *, mqtt_frame_t *items, int max);
+/* Splits data into complete frames, returns how many were found */
+int  mqtt_frames_scan(mqtt_frames_t *, const uint8_t *data, int size);
+/* View over a scanned frame, without decoding the fixed header again */
+void mqtt_frame_view(const mqtt_frame_t *, uint8_t *data, mqtt_view_t *view);
+
+/* Compact in place representation: text fields are 16 bit offsets into the
+   frame instead of pointers and each message type has its own struct, so
+   frames up to 64K can be kept with a few bytes of bookkeeping */
+typedef struct mqtt_span_s
+{
+	uint16_t offset;
+	uint16_t length;
+} mqtt_span_t;
+
+typedef struct mqtt_compact_header_s
+{
+	uint8_t  ctrl;
+	uint8_t  offset; // start of variable header
+	uint16_t length; // remaining length
+} mqtt_compact_header_t;
+
+typedef struct mqtt_compact_connect_s
+{
+	mqtt_compact_header_t header;
+	uint8_t               level;
+	uint8_t               flags;
+	uint16_t              keepalive;
+	mqtt_span_t           client_id;
+	mqtt_span_t           will_topic;
+	mqtt_span_t           will_message;
+	mqtt_span_t           username;
+	mqtt_span_t           password;
+} mqtt_compact_connect_t;
+
+typedef struct mqtt_compact_publish_s
+{
+	mqtt_compact_header_t header;
+	uint16_t              packetid;
+	mqtt_span_t           topic;
+	mqtt_span_t           payload;
+} mqtt_compact_publish_t;
+
+/* CONNACK, PUBACK, PUBREC, PUBREL, PUBCOMP, UNSUBACK */
+typedef struct mqtt_compact_ack_s
+{
+	mqtt_compact_header_t header;
+	uint16_t              msgid; // CONNACK: flags << 8 | return code
+} mqtt_compact_ack_t;
+
+/* SUBSCRIBE, UNSUBSCRIBE, SUBACK: items are walked with mqtt_view_next_item */
+typedef struct mqtt_compact_subscribe_s
+{
+	mqtt_compact_header_t header;
+	uint16_t              msgid;
+	uint16_t              count;
+} mqtt_compact_subscribe_t;
+
+/* Readers return 0 on success, -1 if the frame is incomplete, too big or of another type */
+int  mqtt_compact_connect_read(mqtt_compact_connect_t *, uint8_t *data, int size);
+int  mqtt_compact_publish_read(mqtt_compact_publish_t *, uint8_t *data, int size);
+int  mqtt_compact_ack_read(mqtt_compact_ack_t *, uint8_t *data, int size);
+int  mqtt_compact_subscribe_read(mqtt_compact_subscribe_t *, uint8_t *data, int size);
+/* view is filled from the compact header and must outlive iter */
+void mqtt_compact_items(const mqtt_compact_subscribe_t *, uint8_t *data, mqtt_view_t *view, mqtt_view_iter_t *iter);
+/* Resolves a span against the frame it was read from */
+void mqtt_compact_text(mqtt_text_t *text, uint8_t *data, mqtt_span_t span);
+
+/* Receive side QoS 2 session state: one bit per packet id, set from the
+   delivered PUBLISH until its PUBREL. QoS 1 needs no state: it is always
+   delivered, and flagged when the sender marked it DUP */
+typedef struct mqtt_inbound_s
+{
+	uint32_t delivered[65536 / 32];
+} mqtt_inbound_t;
+
+enum mqtt_inbound_e
+{
+	MQTT_INBOUND_DROP = 0,  // retransmitted QoS 2 PUBLISH or a control packet
+	MQTT_INBOUND_DELIVER,
+	MQTT_INBOUND_DUPLICATE, // deliver, but it may have been delivered before
+};
+
+void mqtt_inbound_init(mqtt_inbound_t *);
+/* Tracks an incoming PUBLISH or PUBREL and fills ack with the reply to send
+   (header.ctrl is 0 when there is none). Returns a mqtt_inbound_e, non zero
+   if the message must be delivered to the application */
+int  mqtt_inbound_receive(mqtt_inbound_t *, uint8_t ctrl, uint16_t packetid, mqtt_message_t *ack);
+/* Compact form for sessions resumed with clean = 0: returns the bytes needed,
+   nothing is written past size */
+int  mqtt_inbound_save(const mqtt_inbound_t *, uint8_t *data, int size);
+int  mqtt_inbound_load(mqtt_inbound_t *, const uint8_t *data, int size);
+
 #endif
\ No newline at end of file